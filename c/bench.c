@@ -0,0 +1,445 @@
+// ストレージエンジンのベンチマーク
+// db.cを直接リンクするので，rspecのようにプロセスやパイプのオーバーヘッドが入らない
+//
+// 使い方:
+// ./dbbench [--rows 10000,100000] [--workloads seq_insert,point_lookup] [--ops N] [--compress] [--write-buffer]
+//           [--direct-io] [--huge-pages] [--pax] [--hash-index]
+// ./dbbench --replay trace.bin --db test.db
+//
+// 結果は1行1計測のCSVで標準出力に書き出す
+// workload,rows,ops,seconds,ops_per_sec,p50_ns,p99_ns,pages_read,pages_written,status
+//
+// 1 opの単位
+// - seq_insert, random_insert: 1行のinsert
+// - point_lookup: table_seekによる1回の検索 (--hash-indexなら索引から引く)
+// - full_scan: テーブル全体の1回の走査
+// - range_scan: ランダムな位置からRANGE_SCAN_LENGTH行の走査
+// - column_scan: usernameだけをwhere句で調べるテーブル全体の1回の走査
+// - replay: ./db --trace で記録したget_pageの呼び出し1回
+
+#define DB_NO_MAIN
+#include "db.c"
+
+#include <sys/wait.h>
+
+const uint32_t RANGE_SCAN_LENGTH = 100;
+const uint32_t FULL_SCAN_PASSES = 10;
+// column_scanのwhere句 (username like 'user9%')
+const char COLUMN_SCAN_PREFIX[] = "user9";
+
+typedef enum {
+    WORKLOAD_SEQ_INSERT,
+    WORKLOAD_RANDOM_INSERT,
+    WORKLOAD_POINT_LOOKUP,
+    WORKLOAD_FULL_SCAN,
+    WORKLOAD_RANGE_SCAN,
+    WORKLOAD_COLUMN_SCAN
+} Workload;
+
+#define NUM_WORKLOADS 6
+
+const char* WORKLOAD_NAMES[NUM_WORKLOADS] = {
+    "seq_insert",
+    "random_insert",
+    "point_lookup",
+    "full_scan",
+    "range_scan",
+    "column_scan",
+};
+
+typedef struct {
+    uint32_t rows;
+    uint64_t ops; // 0なら計測ごとの既定値を使う
+    uint32_t flags;
+    bool use_write_buffer;
+} BenchConfig;
+
+typedef struct {
+    uint64_t ops;
+    uint64_t elapsed_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t pages_read;
+    uint64_t pages_written;
+} BenchResult;
+
+// 再現できるように固定のseedから作る乱数 (xorshift64)
+uint64_t bench_random_state = 88172645463325252ULL;
+
+uint64_t bench_random() {
+    bench_random_state ^= bench_random_state << 13;
+    bench_random_state ^= bench_random_state >> 7;
+    bench_random_state ^= bench_random_state << 17;
+    return bench_random_state;
+}
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// 1 - rowsのidをシャッフルした配列
+uint32_t* shuffled_ids(uint32_t rows) {
+    uint32_t* ids = malloc(sizeof(uint32_t) * rows);
+    for (uint32_t i = 0; i < rows; i++) {
+        ids[i] = i + 1;
+    }
+    for (uint32_t i = rows; i > 1; i--) {
+        uint32_t j = bench_random() % i;
+        uint32_t tmp = ids[i - 1];
+        ids[i - 1] = ids[j];
+        ids[j] = tmp;
+    }
+    return ids;
+}
+
+Table* bench_open(const char* filename, BenchConfig* config) {
+    Table* table = db_open(filename, config->flags);
+    if (config->use_write_buffer) {
+        table->write_buffer = new_write_buffer(table);
+    }
+    return table;
+}
+
+void bench_insert(Table* table, uint32_t id) {
+    Statement statement;
+    memset(&statement, 0, sizeof(Statement));
+    statement.type = STATEMENT_INSERT;
+    statement.row_to_insert.id = id;
+    snprintf(statement.row_to_insert.username, sizeof(statement.row_to_insert.username), "user%u", id);
+    snprintf(statement.row_to_insert.email, sizeof(statement.row_to_insert.email), "person%u@example.com", id);
+
+    if (execute_insert(&statement, table) != EXECUTE_SUCCESS) {
+        fprintf(stderr, "insert %u failed\n", id);
+        exit(EXIT_FAILURE);
+    }
+}
+
+uint64_t bench_full_scan(Table* table) {
+    uint64_t checksum = 0;
+    Cursor* cursor = table_start(table);
+    while (!(cursor->end_of_table)) {
+        checksum += *cursor_key(cursor);
+        cursor_advance(cursor);
+    }
+    free(cursor);
+    return checksum;
+}
+
+uint64_t bench_range_scan(Table* table, uint32_t start) {
+    uint64_t checksum = 0;
+    Cursor* cursor = table_find(table, start);
+    void* node = get_page(table->pager, cursor->page_num);
+    cursor->end_of_table = cursor->cell_num >= *leaf_node_num_cells(node);
+
+    for (uint32_t i = 0; i < RANGE_SCAN_LENGTH && !(cursor->end_of_table); i++) {
+        checksum += *cursor_key(cursor);
+        cursor_advance(cursor);
+    }
+    free(cursor);
+    return checksum;
+}
+
+bool bench_sum_key(Statement* statement, uint32_t key, const char* username, const char* email, void* context) {
+    // 結果が捨てられないように，キーだけを足し合わせる
+    (void)statement;
+    (void)username;
+    (void)email;
+    *(uint64_t*)context += key;
+    return true;
+}
+
+uint64_t bench_column_scan(Table* table) {
+    Statement statement;
+    memset(&statement, 0, sizeof(Statement));
+    statement.type = STATEMENT_SELECT;
+    statement.where.op = PREDICATE_PREFIX;
+    statement.where.column = COLUMN_USERNAME;
+    strcpy(statement.where.pattern, COLUMN_SCAN_PREFIX);
+    statement.where.pattern_length = strlen(COLUMN_SCAN_PREFIX);
+
+    uint64_t checksum = 0;
+    scan_table(table, &statement, bench_sum_key, &checksum);
+    return checksum;
+}
+
+// 1つの計測を実行する
+// 読み込みの計測は，テーブルを作って閉じた後に開き直し，キャッシュが空の状態から始める
+void run_workload(Workload workload, BenchConfig* config, const char* filename, BenchResult* result) {
+    uint32_t rows = config->rows;
+    uint64_t ops;
+    switch (workload) {
+        case (WORKLOAD_SEQ_INSERT):
+        case (WORKLOAD_RANDOM_INSERT):
+            ops = rows;
+            break;
+        case (WORKLOAD_FULL_SCAN):
+        case (WORKLOAD_COLUMN_SCAN):
+            ops = config->ops ? config->ops : FULL_SCAN_PASSES;
+            break;
+        default:
+            ops = config->ops ? config->ops : rows;
+            break;
+    }
+
+    uint32_t* ids = shuffled_ids(rows);
+    Table* table = bench_open(filename, config);
+
+    if (workload != WORKLOAD_SEQ_INSERT && workload != WORKLOAD_RANDOM_INSERT) {
+        for (uint32_t i = 1; i <= rows; i++) {
+            bench_insert(table, i);
+        }
+        db_close(table);
+        // 閉じる時に書いた<file>-hotがあると開く時に全ページを読み込んでしまうので，消してから開き直す
+        char hot_path[strlen(filename) + sizeof("-hot")];
+        sprintf(hot_path, "%s-hot", filename);
+        unlink(hot_path);
+        table = bench_open(filename, config);
+    }
+
+    uint64_t* latencies = malloc(sizeof(uint64_t) * (ops > 0 ? ops : 1));
+    volatile uint64_t checksum = 0;
+    stats_reset();
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < ops; i++) {
+        uint64_t op_start = now_ns();
+        switch (workload) {
+            case (WORKLOAD_SEQ_INSERT):
+                bench_insert(table, i + 1);
+                break;
+            case (WORKLOAD_RANDOM_INSERT):
+                bench_insert(table, ids[i]);
+                break;
+            case (WORKLOAD_POINT_LOOKUP): {
+                Cursor* cursor = table_seek(table, ids[i % rows]);
+                checksum += cursor->cell_num;
+                free(cursor);
+                break;
+            }
+            case (WORKLOAD_FULL_SCAN):
+                checksum += bench_full_scan(table);
+                break;
+            case (WORKLOAD_RANGE_SCAN):
+                checksum += bench_range_scan(table, ids[i % rows]);
+                break;
+            case (WORKLOAD_COLUMN_SCAN):
+                checksum += bench_column_scan(table);
+                break;
+        }
+        latencies[i] = now_ns() - op_start;
+    }
+
+    // 書き込みは閉じる時に行われるので，計測に含める
+    db_close(table);
+    result->elapsed_ns = now_ns() - start;
+
+    qsort(latencies, ops, sizeof(uint64_t), compare_u64);
+    result->ops = ops;
+    result->p50_ns = ops > 0 ? latencies[ops / 2] : 0;
+    result->p99_ns = ops > 0 ? latencies[(ops * 99) / 100 < ops ? (ops * 99) / 100 : ops - 1] : 0;
+    result->pages_read = stats.pages_read;
+    result->pages_written = stats.pages_written;
+
+    free(latencies);
+    free(ids);
+}
+
+// エンジンは回復できないエラーでexitするので，計測ごとに子プロセスで実行する
+// 子プロセスの標準出力は捨て，結果だけをパイプで受け取る
+void bench(Workload workload, BenchConfig* config) {
+    char filename[] = "/tmp/sqlitelite-bench-XXXXXX";
+    int fd = mkstemp(filename);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to create bench file\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        fprintf(stderr, "Unable to create pipe\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+
+        BenchResult result;
+        run_workload(workload, config, filename, &result);
+        write(pipe_fds[1], &result, sizeof(BenchResult));
+        exit(EXIT_SUCCESS);
+    }
+    close(pipe_fds[1]);
+
+    BenchResult result;
+    ssize_t bytes_read = read(pipe_fds[0], &result, sizeof(BenchResult));
+    close(pipe_fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    unlink(filename);
+    char hot_path[sizeof(filename) + sizeof("-hot")];
+    sprintf(hot_path, "%s-hot", filename);
+    unlink(hot_path);
+
+    const char* name = WORKLOAD_NAMES[workload];
+    if (bytes_read != sizeof(BenchResult) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        // 今の木は中間ノードを分割できないので，大きなテーブルではここに来る
+        printf("%s,%u,,,,,,,,aborted\n", name, config->rows);
+        return;
+    }
+
+    double seconds = result.elapsed_ns / 1e9;
+    printf("%s,%u,%llu,%.6f,%.1f,%llu,%llu,%llu,%llu,ok\n",
+        name,
+        config->rows,
+        (unsigned long long)result.ops,
+        seconds,
+        seconds > 0 ? result.ops / seconds : 0,
+        (unsigned long long)result.p50_ns,
+        (unsigned long long)result.p99_ns,
+        (unsigned long long)result.pages_read,
+        (unsigned long long)result.pages_written);
+}
+
+// ./db --trace で記録したページアクセスを同じ順番で再現する
+// ファイルを書き換えないように，db_closeは呼ばない
+void replay(const char* trace_path, const char* filename) {
+    FILE* file = fopen(trace_path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open trace file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t capacity = 1024;
+    uint64_t ops = 0;
+    TraceRecord* records = malloc(sizeof(TraceRecord) * capacity);
+    while (fread(&(records[ops]), sizeof(TraceRecord), 1, file) == 1) {
+        ops++;
+        if (ops == capacity) {
+            capacity *= 2;
+            records = realloc(records, sizeof(TraceRecord) * capacity);
+        }
+    }
+    fclose(file);
+
+    Table* table = db_open(filename, 0);
+    uint64_t* latencies = malloc(sizeof(uint64_t) * (ops > 0 ? ops : 1));
+    stats_reset();
+
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < ops; i++) {
+        uint64_t op_start = now_ns();
+        get_page(table->pager, records[i].page_num);
+        latencies[i] = now_ns() - op_start;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    qsort(latencies, ops, sizeof(uint64_t), compare_u64);
+    printf("replay,,%llu,%.6f,%.1f,%llu,%llu,%llu,0,ok\n",
+        (unsigned long long)ops,
+        seconds,
+        seconds > 0 ? ops / seconds : 0,
+        (unsigned long long)(ops > 0 ? latencies[ops / 2] : 0),
+        (unsigned long long)(ops > 0 ? latencies[(ops * 99) / 100] : 0),
+        (unsigned long long)stats.pages_read);
+
+    free(latencies);
+    free(records);
+}
+
+int main(int argc, char* argv[]) {
+    const char* rows_list = "32";
+    const char* workloads_list = NULL;
+    const char* trace_path = NULL;
+    const char* db_path = NULL;
+    BenchConfig config;
+    config.ops = 0;
+    config.flags = 0;
+    config.use_write_buffer = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            rows_list = argv[++i];
+        } else if (strcmp(argv[i], "--workloads") == 0 && i + 1 < argc) {
+            workloads_list = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--db") == 0 && i + 1 < argc) {
+            db_path = argv[++i];
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            config.ops = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            config.flags |= DB_OPEN_COMPRESSED;
+        } else if (strcmp(argv[i], "--direct-io") == 0) {
+            config.flags |= DB_OPEN_DIRECT_IO;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            config.flags |= DB_OPEN_HUGE_PAGES;
+        } else if (strcmp(argv[i], "--pax") == 0) {
+            config.flags |= DB_OPEN_PAX_LEAVES;
+        } else if (strcmp(argv[i], "--hash-index") == 0) {
+            config.flags |= DB_OPEN_HASH_INDEX;
+        } else if (strcmp(argv[i], "--write-buffer") == 0) {
+            config.use_write_buffer = true;
+        } else {
+            fprintf(stderr, "Unrecognized option '%s'.\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (trace_path != NULL) {
+        if (db_path == NULL) {
+            fprintf(stderr, "--replay requires --db.\n");
+            exit(EXIT_FAILURE);
+        }
+        printf("workload,rows,ops,seconds,ops_per_sec,p50_ns,p99_ns,pages_read,pages_written,status\n");
+        replay(trace_path, db_path);
+        return 0;
+    }
+
+    bool enabled[NUM_WORKLOADS];
+    for (uint32_t i = 0; i < NUM_WORKLOADS; i++) {
+        enabled[i] = workloads_list == NULL;
+    }
+    if (workloads_list != NULL) {
+        char* list = strdup(workloads_list);
+        for (char* name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+            bool found = false;
+            for (uint32_t i = 0; i < NUM_WORKLOADS; i++) {
+                if (strcmp(name, WORKLOAD_NAMES[i]) == 0) {
+                    enabled[i] = true;
+                    found = true;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "Unknown workload '%s'.\n", name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        free(list);
+    }
+
+    printf("workload,rows,ops,seconds,ops_per_sec,p50_ns,p99_ns,pages_read,pages_written,status\n");
+
+    char* list = strdup(rows_list);
+    for (char* rows = strtok(list, ","); rows != NULL; rows = strtok(NULL, ",")) {
+        config.rows = strtoul(rows, NULL, 10);
+        if (config.rows == 0) {
+            continue;
+        }
+        for (uint32_t i = 0; i < NUM_WORKLOADS; i++) {
+            if (enabled[i]) {
+                bench(i, &config);
+            }
+        }
+    }
+    free(list);
+
+    return 0;
+}
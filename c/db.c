@@ -13,14 +13,35 @@
 // - pager
 // - os interface
 
+// O_DIRECTとMADV_HUGEPAGEを使う
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+// where句の文字列比較で使うSIMD命令
+// make CFLAGS=-mavx2 でAVX2版，x86_64ではデフォルトでSSE2版，それ以外はスカラー版になる
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
@@ -47,9 +68,13 @@ typedef enum {
 
 typedef enum {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    STATEMENT_DELETE,
+    STATEMENT_UPDATE
 } StatementType;
 
+#define NUM_STATEMENT_TYPES 4
+
 // 以下のテーブルのデータを表す構造体
 // 内部表現として使う
 typedef struct {
@@ -82,27 +107,178 @@ const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 const uint32_t PAGE_SIZE = 4096;
 const uint32_t TABLE_MAX_PAGES = 100;
 
+// 圧縮モードのファイルで，各ページが格納されている領域
+typedef struct {
+    uint64_t offset; // ファイル上の位置
+    uint32_t length; // 圧縮後のサイズ (0ならまだ書き出していない)
+    uint32_t capacity; // 確保済みの領域のサイズ (length以下に縮んでもそのまま使う)
+} PageSlot;
+
+// ある時点の木の内容
+// 開いている間に変更されるページは，変更前の内容をここに退避しておく
+// 退避していないページは現在のページと同じ内容なので，そのまま読めばよい
+typedef struct Snapshot {
+    void* pages[TABLE_MAX_PAGES]; // 退避したページ (NULLなら退避していない)
+    uint32_t num_pages;           // 開いた時のページ数 (これ以降のページは見えない)
+    struct Snapshot* next;        // 同じpagerで開いているスナップショットのリスト
+} Snapshot;
+
+// db_openに渡すフラグ
+typedef enum {
+    DB_OPEN_COMPRESSED = 1 << 0, // 新規ファイルを圧縮モードで作成する
+    DB_OPEN_DIRECT_IO = 1 << 1,  // O_DIRECTでOSのページキャッシュを通さずに読み書きする
+    DB_OPEN_HUGE_PAGES = 1 << 2, // ページの枠をtransparent huge pagesで確保する
+    DB_OPEN_PAX_LEAVES = 1 << 3, // 新規ファイルの葉をPAX形式で作る
+    DB_OPEN_HASH_INDEX = 1 << 4  // 新規ファイルにidのhash索引を作る
+} DbOpenFlag;
+
+// 葉のセルの並べ方
+// ROWは1行分の列をセルにまとめて並べ，PAXは列ごとに葉の中の領域(minipage)へまとめる
+typedef enum { LEAF_LAYOUT_ROW, LEAF_LAYOUT_PAX } LeafLayout;
+
+// --huge-pagesの時に枠の領域を揃える大きさ
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
 typedef struct {
     // ファイルディスクリプタについて
     // http://e-words.jp/w/%E3%83%95%E3%82%A1%E3%82%A4%E3%83%AB%E3%83%87%E3%82%A3%E3%82%B9%E3%82%AF%E3%83%AA%E3%83%97%E3%82%BF.html
     int file_descriptor;
-    uint32_t file_length;
+    uint64_t file_length;
+    // ファイルの形式 (File Header参照)
+    uint32_t format_version;
+    uint32_t header_size; // ページより前にあるヘッダの大きさ
     // void* は汎用ポインタ型
     // あらゆるポインタの方に変換できる
     // anyっぽさある
     uint32_t num_pages;
     void* pages[TABLE_MAX_PAGES];
+    // ページの枠 (page frame)
+    // pager_openで全ページ分をページ境界に揃った一つの領域として確保し，ページ番号の位置の枠をそのページに使う
+    // ページは追い出さないので，枠を使い回す必要はない
+    void* frames;
+    void* frames_mapping; // munmapする領域 (huge pagesの境界に揃えるため，framesより大きく確保する)
+    size_t frames_mapping_size;
+    uint32_t flags; // pager_openに渡したDbOpenFlag (.vacuumで開き直す時に使う)
+    bool direct_io;
+    LeafLayout leaf_layout; // 新しく作る葉の形式 (ファイルのヘッダに記録する)
+    bool hash_index;        // idのhash索引を保持している (Hash Index Layout参照)
+    // 圧縮モードの場合のみ使う
+    // ページ番号からファイル上の可変長の領域への対応表 (page translation table)
+    bool compressed;
+    uint64_t file_end; // 領域を追加する位置
+    PageSlot slots[TABLE_MAX_PAGES];
+    // 使われていない領域 (大きくなったページが移った後に残ったもの)
+    // 新しい領域はまずここから探す．ファイルには記録せず，開く時にslotの間の隙間から作り直す
+    PageSlot free_regions[TABLE_MAX_PAGES];
+    uint32_t num_free_regions;
+    // 最後に書き出してから変更されたページ
+    // db_closeや書き込みスレッドはこのページだけを書き出す
+    bool dirty[TABLE_MAX_PAGES];
+    uint32_t num_dirty;
+    // 文の実行と書き込みスレッドの排他に使う
+    // 文の実行中はずっと保持するので，書き込み中のページが変更されることはない
+    pthread_mutex_t lock;
+    // バックグラウンドの書き込みスレッド (--background-writer指定時のみ)
+    bool writer_running;
+    bool writer_stopping;
+    pthread_t writer;
+    pthread_cond_t writer_wakeup;
+    // ページごとのアクセス回数
+    // 閉じる時にキャッシュにあったページと一緒に記録し，次に開いた時に先に読み込む
+    uint32_t access_counts[TABLE_MAX_PAGES];
+    char* hot_path; // 記録するファイル (<dbファイル名>-hot)
+    // 最後のバックアップの後に変更したページのビットマップ
+    // pager_mark_dirtyで立て，pager_flushで書き出す時に<dbファイル名>-changedにも記録する
+    // (changed_savedは記録済みのビット)．一度もバックアップしていなければ記録しない (changed_fd == -1)
+    uint8_t changed[(TABLE_MAX_PAGES + 7) / 8];
+    uint8_t changed_saved[(TABLE_MAX_PAGES + 7) / 8];
+    int changed_fd;
+    char* changed_path;
+    char* last_backup_path; // 最後のバックアップのファイル (incrementalはここにしか書けない)
+    char* filename;
+    Snapshot* snapshots; // 開いているスナップショット
 } Pager;
 
+// ダーティページがキャッシュのこの割合(%)を超えたら書き込みスレッドを起こす
+const uint32_t WRITER_DIRTY_THRESHOLD_PERCENT = 10;
+// 閾値を超えなくても，この間隔(ms)ごとに溜まったダーティページを書き出す
+const uint32_t WRITER_INTERVAL_MS = 100;
+
+// ビットマップのサイズ (bit)
+#define WRITE_BUFFER_BLOOM_BITS 8192
+// 木のキー用のビットマップのサイズ (bit)
+// TABLE_MAX_PAGES枚の葉ノードが満杯でも偽陽性は1%程度
+#define WRITE_BUFFER_TREE_BLOOM_BITS 16384
+
+// 挿入をまとめて木へ書き込むためのメモリ上のバッファ
+// セルはキー順に並べておき，満杯になったらキー順に木へ書き出す
+typedef struct {
+    void* cells; // 葉ノードのセルと同じ形式 (キー + シリアライズした行)
+    uint32_t num_cells;
+    // バッファ内のキーのBloom filter
+    // 含まれていないキーは二分探索せずに重複なしと判定できる
+    uint64_t bloom[WRITE_BUFFER_BLOOM_BITS / 64];
+    // 木に入っているキーのBloom filter
+    // 含まれていないキーは木を辿らずに重複なしと判定できる
+    // 削除したキーのビットは消せないが，偽陽性が増えるだけ
+    uint64_t tree_bloom[WRITE_BUFFER_TREE_BLOOM_BITS / 64];
+} WriteBuffer;
+
 typedef struct {
     uint32_t num_rows;
     Pager* pager;
     uint32_t root_page_num;
+    WriteBuffer* write_buffer; // --write-buffer指定時のみ使う
+    Snapshot* snapshot; // .snapshot beginで開いたもの
+    // 木を読む時に使うスナップショット (NULLなら現在の木)
+    // スナップショットからのselectだけが，表の複製に設定して使う．書き込みは常に現在の木に対して行う
+    Snapshot* view;
 } Table;
 
+// selectで指定できる列
+typedef enum {
+    COLUMN_ID,
+    COLUMN_USERNAME,
+    COLUMN_EMAIL
+} Column;
+
+#define MAX_SELECT_COLUMNS 3
+
+// whereで指定できる文字列の比較
+typedef enum {
+    PREDICATE_NONE,
+    PREDICATE_EQUAL,
+    PREDICATE_PREFIX,
+    PREDICATE_SUFFIX,
+    PREDICATE_CONTAINS
+} PredicateOp;
+
+typedef struct {
+    PredicateOp op;
+    Column column;
+    // likeの%は取り除いて保持する
+    char pattern[COLUMN_EMAIL_SIZE + 1];
+    uint32_t pattern_length;
+} Predicate;
+
 typedef struct {
     StatementType type;
-    Row row_to_insert; // insertの時のみ使う
+    Row row_to_insert; // insertの時と，updateで書き換える値に使う
+    // 以下はselectの時のみ使う
+    // 出力する列を指定順に保持する (select id, email なら COLUMN_ID, COLUMN_EMAIL)
+    // updateでは書き換える列を保持する
+    uint32_t num_columns;
+    Column columns[MAX_SELECT_COLUMNS];
+    Predicate where;
+    bool has_order;
+    Column order_by;
+    bool descending;
+    bool has_limit;
+    uint32_t limit;
+    // delete, updateの where id ... はキーの範囲 [key_min, key_max] として保持する
+    // key_min > key_max なら対象の行はない
+    uint32_t key_min;
+    uint32_t key_max;
 } Statement;
 
 typedef enum {
@@ -124,8 +300,18 @@ typedef struct {
     uint32_t page_num;
     uint32_t cell_num;
     bool end_of_table; // 最後の要素の一つ後の位置を指しているかを表す(つまりテーブルの最後)
+    // 先読み (cursor_advanceで葉を続けて辿ったら走査とみなす)
+    uint32_t leaf_hops;           // 続けて次の葉へ進んだ回数
+    uint32_t readahead_window;    // 次に先読みするページ数 (先読みするたびに倍にする)
+    uint32_t readahead_remaining; // 先読み済みで，まだ辿っていない葉の数
 } Cursor;
 
+// この回数だけ続けて次の葉へ進んだら先読みを始める
+const uint32_t READAHEAD_TRIGGER_HOPS = 2;
+const uint32_t READAHEAD_MIN_PAGES = 4;
+// 一度に先読みするページ数の上限
+#define READAHEAD_MAX_PAGES 64
+
 // 各ノードはある一つのページと一致する
 // Internal nodesは子を格納しているページ番号を格納することでポインタのように振舞う
 // btreeはページャーに特定のページ番号を要求し、ページキャッシュへのポインターを取得する
@@ -141,6 +327,12 @@ typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
 // ここでは各ヘッダのフィールドのメタデータのサイズとオフセットを定義する
 const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
 const uint32_t NODE_TYPE_OFFSET = 0;
+// 種類のバイトの最上位bitは葉がPAX形式であることを表す
+const uint8_t NODE_TYPE_MASK = 0x7f;
+const uint8_t NODE_FLAG_PAX = 0x80;
+// hash索引のページも共通ヘッダを持つが，木からは辿らないのでNodeTypeには含めない
+const uint8_t NODE_TYPE_HASH_DIRECTORY = 2;
+const uint8_t NODE_TYPE_HASH_BUCKET = 3;
 const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
@@ -174,6 +366,288 @@ const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
 const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
 
+/*
+ * PAX Leaf Node Body Layout
+ */
+// | key 0 ... key N-1 | id 0 ... id N-1 | username 0 ... | email 0 ... | (N = LEAF_NODE_MAX_CELLS)
+// 列ごとのminipageに並べるので，一つの列だけを読む走査はその列を連続して読むだけで済む
+// 容量は行形式と同じにして，どちらの形式でも木の形が変わらないようにする
+const uint32_t PAX_LEAF_NODE_KEYS_OFFSET = LEAF_NODE_HEADER_SIZE;
+const uint32_t PAX_LEAF_NODE_IDS_OFFSET =
+        PAX_LEAF_NODE_KEYS_OFFSET + LEAF_NODE_MAX_CELLS * LEAF_NODE_KEY_SIZE;
+const uint32_t PAX_LEAF_NODE_USERNAMES_OFFSET =
+        PAX_LEAF_NODE_IDS_OFFSET + LEAF_NODE_MAX_CELLS * ID_SIZE;
+const uint32_t PAX_LEAF_NODE_EMAILS_OFFSET =
+        PAX_LEAF_NODE_USERNAMES_OFFSET + LEAF_NODE_MAX_CELLS * USERNAME_SIZE;
+
+/*
+ * order by
+ */
+// limitがこれ以下ならk行のヒープだけで上位k件を求める
+// それより大きい場合やlimitがない場合は外部マージソートを使う
+const uint32_t TOP_K_MAX_ROWS = 1024;
+// 外部マージソートでメモリ上に保持する1runの行数
+const uint32_t SORT_RUN_ROWS = 1024;
+// マージ時に各runから先読みする行数
+#define RUN_READER_ROWS 16
+
+typedef struct {
+    Row row;
+    uint32_t run; // 外部ソートのマージ時に，行を読み出したrunの番号
+} SortEntry;
+
+typedef struct {
+    Statement* statement;
+    SortEntry* entries;
+    uint32_t size;
+    uint32_t capacity;
+    // 1: 根が出力順で最後の行になる (上位k件の保持, ソート用)
+    // -1: 根が出力順で最初の行になる (runのマージ用)
+    int32_t order;
+} RowHeap;
+
+// ソート済みrunを一時ファイルから少しずつ読み出す
+typedef struct {
+    off_t offset; // 次に読む行のファイル上の位置
+    uint32_t remaining; // まだファイルから読んでいない行数
+    Row rows[RUN_READER_ROWS];
+    uint32_t num_rows;
+    uint32_t position;
+} RunReader;
+
+typedef struct {
+    RowHeap buffer;
+    FILE* file; // runを書き出す一時ファイル
+    uint32_t num_runs;
+    uint32_t* run_lengths;
+} ExternalSort;
+
+/*
+ * File Header
+ */
+// | magic | format_version | page_num_size | flags | ...
+// version 2からファイルの先頭にヘッダを置き，ページはその後ろに並べる
+// ノードに書くページ番号の幅(page_num_size)を記録しておき，広げる時に古いファイルと区別できるようにする
+// version 1 (ヘッダなし) のファイルもそのまま読み書きでき，.vacuumでversion 2に変換できる
+const char FILE_MAGIC[16] = "sqlitelite-db";
+const uint32_t FILE_MAGIC_SIZE = sizeof(FILE_MAGIC);
+const uint32_t FILE_VERSION_OFFSET = FILE_MAGIC_SIZE;
+const uint32_t FILE_PAGE_NUM_SIZE_OFFSET = FILE_VERSION_OFFSET + sizeof(uint32_t);
+const uint32_t FILE_FLAGS_OFFSET = FILE_PAGE_NUM_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t FILE_COMMON_HEADER_SIZE = FILE_FLAGS_OFFSET + sizeof(uint32_t);
+const uint32_t FILE_FORMAT_VERSION = 2;
+const uint32_t FILE_LEGACY_VERSION = 1;
+const uint32_t FILE_FLAG_COMPRESSED = 1 << 0;
+const uint32_t FILE_FLAG_PAX_LEAVES = 1 << 1;
+const uint32_t FILE_FLAG_HASH_INDEX = 1 << 2;
+const uint32_t PAGE_NUM_SIZE = sizeof(uint32_t);
+// 通常のファイルのヘッダの大きさ．ページの位置がページの大きさに揃うようにする
+const uint32_t FILE_HEADER_SIZE = PAGE_SIZE;
+
+/*
+ * Compressed File Layout
+ */
+// | ヘッダ | num_pages | slot 0 | slot 1 | ... | slot TABLE_MAX_PAGES-1 | 圧縮したページ ...
+// 各slotはページ番号ごとの (offset, length, capacity)
+// 圧縮したページは可変長なので，ページ番号からは位置を計算できない
+const uint32_t COMPRESSED_NUM_PAGES_OFFSET = FILE_COMMON_HEADER_SIZE;
+const uint32_t COMPRESSED_SLOTS_OFFSET = COMPRESSED_NUM_PAGES_OFFSET + sizeof(uint32_t);
+const uint32_t COMPRESSED_HEADER_SIZE = COMPRESSED_SLOTS_OFFSET + TABLE_MAX_PAGES * sizeof(PageSlot);
+// version 1では | magic | num_pages | slot ... | で，slotのoffsetが32bitだった
+const char LEGACY_COMPRESSED_FILE_MAGIC[16] = "sqlitelite-zrun";
+const uint32_t LEGACY_COMPRESSED_NUM_PAGES_OFFSET = sizeof(LEGACY_COMPRESSED_FILE_MAGIC);
+const uint32_t LEGACY_COMPRESSED_SLOTS_OFFSET = LEGACY_COMPRESSED_NUM_PAGES_OFFSET + sizeof(uint32_t);
+const uint32_t LEGACY_COMPRESSED_SLOT_SIZE = 3 * sizeof(uint32_t);
+const uint32_t LEGACY_COMPRESSED_HEADER_SIZE =
+    LEGACY_COMPRESSED_SLOTS_OFFSET + TABLE_MAX_PAGES * LEGACY_COMPRESSED_SLOT_SIZE;
+// 書き直しで少し大きくなってもその場で上書きできるように，領域はこの単位で確保する
+const uint32_t COMPRESSED_SLOT_ALIGNMENT = 64;
+// 圧縮できないページでも，この長さを超えることはない
+// (128バイトごとに1バイトのトークンが付く)
+const uint32_t COMPRESSED_PAGE_MAX_SIZE = PAGE_SIZE + PAGE_SIZE / 128 + 1;
+
+/*
+ * Hot Page File Layout
+ */
+// | magic | num_entries | (page_num, access_count) ... |
+// ただのヒントなので，壊れていたり古かったりしても読み飛ばすだけ
+const char HOT_FILE_MAGIC[16] = "sqlitelite-hot";
+const uint32_t HOT_MAGIC_SIZE = sizeof(HOT_FILE_MAGIC);
+const uint32_t HOT_HEADER_SIZE = HOT_MAGIC_SIZE + sizeof(uint32_t);
+const uint32_t HOT_ENTRY_SIZE = 2 * sizeof(uint32_t);
+// 一度のpreadvで読み込むページ数の上限
+#define PRELOAD_MAX_IOV 64
+
+/*
+ * Changed Page File Layout
+ */
+// | magic | bitmap | path_length | path |
+// bitmapは最後のバックアップの後に変更して書き出したページ，pathはそのバックアップのファイル
+// 書き出したページのビットがまだ記録されていなければ，bitmapの1バイトだけを書き直す
+const char CHANGED_FILE_MAGIC[16] = "sqlitelite-chg";
+const uint32_t CHANGED_MAGIC_SIZE = sizeof(CHANGED_FILE_MAGIC);
+const uint32_t CHANGED_BITMAP_OFFSET = CHANGED_MAGIC_SIZE;
+const uint32_t CHANGED_BITMAP_SIZE = (TABLE_MAX_PAGES + 7) / 8;
+const uint32_t CHANGED_PATH_LENGTH_OFFSET = CHANGED_BITMAP_OFFSET + CHANGED_BITMAP_SIZE;
+const uint32_t CHANGED_PATH_OFFSET = CHANGED_PATH_LENGTH_OFFSET + sizeof(uint32_t);
+#define CHANGED_MAX_PATH 4096
+
+// .vacuumで充填率を省略した場合の値 (%)
+// 100にすると，次の挿入で葉と中間ノードの分割が必要になる
+const uint32_t VACUUM_DEFAULT_FILL_PERCENT = 90;
+const uint32_t VACUUM_MIN_FILL_PERCENT = 10;
+
+/*
+ * Server Protocol
+ */
+// 要求: | length | statement |
+// 応答: | length | output |   (outputはREPLで表示されるのと同じ文字列)
+// lengthはリトルエンディアンのuint32で，後ろに続くバイト数
+// 応答を待たずに続けて要求を送ってよく (パイプライン)，応答は要求の順に返る
+const uint32_t SERVER_FRAME_HEADER_SIZE = sizeof(uint32_t);
+const uint32_t SERVER_MAX_REQUEST_SIZE = 4096;
+const int SERVER_LISTEN_BACKLOG = 256;
+#define SERVER_WORKERS 4
+#define SERVER_MAX_EVENTS 64
+// --connectで応答を待たずに送る要求の数
+const uint32_t CLIENT_PIPELINE_DEPTH = 64;
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} ByteBuffer;
+
+// 接続ごとの状態 (イベントループのスレッドだけが触る)
+typedef struct Connection {
+    int fd;
+    ByteBuffer in;      // まだワーカーに渡していない要求
+    ByteBuffer out;     // まだ送れていない応答
+    size_t out_position;
+    // ワーカーが処理中
+    // 応答の順序を保つため，一つの接続の要求は一度に一つのワーカーだけが扱う
+    bool busy;
+    bool closed;        // 閉じた (処理中ならワーカーが終わってから解放する)
+    bool want_write;    // EPOLLOUTを待っている
+    bool read_closed;   // 相手が送信を終えた (EOF)．応答を送りきったら閉じる
+    Snapshot* snapshot; // この接続で.snapshot beginしたもの (処理中のワーカーだけが触る)
+    struct Connection* next;
+} Connection;
+
+// ワーカーに渡す要求の束と，その応答
+typedef struct ServerJob {
+    Connection* connection;
+    ByteBuffer requests;
+    ByteBuffer response;
+    struct ServerJob* next;
+} ServerJob;
+
+typedef struct {
+    Table* table;
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;  // ワーカーが処理を終えたことをイベントループに知らせる
+    int signal_fd; // SIGINT, SIGTERMで終了する
+    Connection* connections;
+    pthread_t workers[SERVER_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready;
+    ServerJob* jobs;      // ワーカーを待っている束
+    ServerJob* jobs_tail;
+    ServerJob* done;      // 応答をまだ送っていない束
+    bool stopping;
+} Server;
+
+/*
+ * Stats
+ */
+// 実行時間のヒストグラムのバケット数
+// i番目のバケットには [2^(i-1), 2^i) ナノ秒の文を数える
+#define LATENCY_BUCKETS 64
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+// .stats で表示するカウンタ
+// 加算するだけなので，計測していない時とほぼ同じ速さで動く
+typedef struct {
+    // get_page
+    uint64_t page_requests;
+    uint64_t page_hits;
+    uint64_t page_misses;
+    uint64_t pages_read;
+    uint64_t bytes_read;
+    // pager_flush
+    uint64_t pages_written;
+    uint64_t bytes_written;
+    uint64_t flush_ns;
+    uint64_t background_pages_written; // pages_writtenのうち書き込みスレッドが書いたもの
+    uint64_t readahead_pages; // posix_fadviseで先読みを指示したページ数
+    uint64_t preloaded_pages; // 開いた時にhotファイルから読み込んだページ数
+    uint64_t snapshot_pages_copied; // スナップショットのために退避したページ数
+    // b-tree
+    uint64_t leaf_splits;
+    uint64_t root_splits;
+    uint64_t internal_node_inserts;
+    uint64_t node_borrows;
+    uint64_t node_merges;
+    uint64_t root_collapses;
+    uint64_t binary_search_probes; // leaf_node_find, internal_node_find_childで比較したキーの数
+    // hash index
+    uint64_t hash_index_probes;  // hash_index_findで見たバケットの数
+    uint64_t hash_bucket_splits;
+    // write buffer
+    uint64_t write_buffer_tree_skips; // 木を辿らずに重複なしと判定した挿入の数
+    LatencyHistogram latency[NUM_STATEMENT_TYPES];
+} Stats;
+
+Stats stats;
+// binary_search_probesを数える先
+// スナップショットからのselectは文のロックの外で木を辿るので，その間だけ文ごとの変数に数える
+__thread uint64_t* search_probes = &(stats.binary_search_probes);
+// 指定されていれば終了時にstatsをJSONで書き出す
+const char* stats_json_path = NULL;
+
+/*
+ * Trace
+ */
+// get_pageの呼び出し1回分の記録
+// --trace <path> で指定したファイルにはこの構造体をそのまま書き出す
+typedef struct {
+    uint32_t page_num;
+    uint8_t flags; // TRACE_PAGE_*
+    uint8_t node_type;
+    uint16_t statement_type;
+} TraceRecord;
+
+#define TRACE_PAGE_HIT (1 << 0) // キャッシュにあった
+#define TRACE_PAGE_NEW (1 << 1) // ファイルの末尾より後ろの新しいページ
+// .explainで表示するページアクセスの最大数
+#define TRACE_MAX_RECORDS 1024
+
+typedef struct {
+    FILE* file;
+    bool explaining; // .explainの実行中
+    StatementType statement_type;
+    uint32_t num_records;
+    TraceRecord records[TRACE_MAX_RECORDS];
+} Trace;
+
+Trace trace;
+
+// 文の結果の出力先 (NULLならstdout)
+// --serveのワーカーはスレッドごとに応答のバッファへ切り替える
+__thread FILE* statement_output = NULL;
+// 文を区切る途中の位置
+// ワーカーが並行して文を解析するので，strtokの代わりにスレッドごとに持つ
+__thread char* token_position = NULL;
+
+// 書き込みバッファが保持するセルの最大数
+const uint32_t WRITE_BUFFER_MAX_CELLS = 256;
+
 // ノードのレイアウトの画像
 // https://cstack.github.io/db_tutorial/assets/images/leaf-node-format.png
 
@@ -188,11 +662,14 @@ void close_input_buffer(InputBuffer*);
 MetaCommandResult do_meta_command(InputBuffer*, Table*);
 PrepareResult prepare_statement(InputBuffer*, Statement*);
 ExecuteResult execute_statement(Statement*, Table*);
+ExecuteResult execute_snapshot_select(Statement*, Table*);
+void run_statement(InputBuffer*, Table*);
 // ========= part2 end ===========
 
 // ========= part3 start ===========
 void serialize_row(Row*, void*);
 void deserialize_row(void*, Row*);
+void assemble_row(Row*, uint32_t, const char*, const char*);
 
 // void* row_slot(Table*, uint32_t);
 void print_row(Row*);
@@ -212,26 +689,60 @@ PrepareResult prepare_insert(InputBuffer*, Statement*);
 
 
 // ========= part5 start ===========
-Pager* pager_open(const char*);
+Pager* pager_open(const char*, uint32_t);
 void* get_page(Pager*, uint32_t);
 
-Table* db_open(const char*);
+Table* db_open(const char*, uint32_t);
 void db_close(Table*);
 void pager_flush(Pager*, uint32_t);
 // ========= part5 end ===========
 
+// ========= vacuum start ===========
+void pager_close(Pager*);
+void print_fragmentation(const char*, Table*);
+void vacuum_table(Table*, uint32_t);
+// ========= vacuum end ===========
+
+// ========= background writer start ===========
+void pager_mark_dirty(Pager*, uint32_t);
+bool pager_dirty_over_threshold(Pager*);
+void* pager_writer_main(void*);
+void pager_start_writer(Pager*);
+void pager_stop_writer(Pager*);
+// ========= background writer end ===========
+
+// ========= warm start start ===========
+void pager_read_page(Pager*, uint32_t, void*);
+void pager_write_hot_pages(Pager*);
+void pager_preload_hot_pages(Pager*);
+int compare_page_nums(const void*, const void*);
+// ========= warm start end ===========
+
 // ========= part6 start ===========
 Cursor* table_start(Table*);
 void cursor_advance(Cursor* cursor);
-void* cursor_value(Cursor* cursor);
+void cursor_row(Cursor*, Row*);
 // ========= part6 end ===========
 
+// ========= readahead start ===========
+void cursor_readahead(Cursor*, uint32_t);
+void pager_readahead(Pager*, uint32_t*, uint32_t);
+// ========= readahead end ===========
+
 // ========= part8 start ===========
 uint32_t* leaf_node_num_cells(void*);
 void* leaf_node_cell(void*, uint32_t);
 uint32_t* leaf_node_key(void*, uint32_t);
 void* leaf_node_value(void*, uint32_t);
-void initialize_leaf_node(void*);
+LeafLayout leaf_node_layout(void*);
+uint32_t* leaf_node_id(void*, uint32_t);
+char* leaf_node_username(void*, uint32_t);
+char* leaf_node_email(void*, uint32_t);
+void leaf_node_read_row(void*, uint32_t, Row*);
+void leaf_node_write_cell(void*, uint32_t, uint32_t, Row*);
+void leaf_node_copy_cells(void*, uint32_t, void*, uint32_t, uint32_t);
+void leaf_node_clear_cells(void*, uint32_t, uint32_t);
+void initialize_leaf_node(void*, LeafLayout);
 void leaf_node_insert(Cursor*, uint32_t, Row*);
 void print_constants();
 // void print_leaf_node(void*);
@@ -278,6 +789,171 @@ void internal_node_insert(Table*, uint32_t, uint32_t);
 uint32_t internal_node_find_child(void*, uint32_t);
 // ========= part13 end ===========
 
+// ========= projection start ===========
+PrepareResult prepare_select(InputBuffer*, Statement*);
+uint32_t* cursor_key(Cursor*);
+char* cursor_username(Cursor*);
+char* cursor_email(Cursor*);
+void print_projection(Statement*, uint32_t, const char*, const char*);
+bool parse_column(const char*, Column*);
+// ========= projection end ===========
+
+// ========= filter start ===========
+PrepareResult prepare_where(Statement*);
+uint32_t field_length(const char*, uint32_t);
+bool field_contains(const char*, uint32_t, const char*, uint32_t);
+bool predicate_match(Predicate*, const char*, const char*);
+// ========= filter end ===========
+
+// ========= sort start ===========
+typedef bool (*ScanCallback)(Statement*, uint32_t, const char*, const char*, void*);
+void scan_table(Table*, Statement*, ScanCallback, void*);
+bool print_matching_row(Statement*, uint32_t, const char*, const char*, void*);
+int compare_rows(Statement*, Row*, Row*);
+void heap_sift_up(RowHeap*, uint32_t);
+void heap_sift_down(RowHeap*, uint32_t);
+void heap_push(RowHeap*, SortEntry*);
+void heap_pop(RowHeap*, SortEntry*);
+void heap_sort(RowHeap*);
+bool top_k_add(Statement*, uint32_t, const char*, const char*, void*);
+void select_top_k(Statement*, Table*);
+void sorter_spill_run(ExternalSort*);
+bool sorter_add(Statement*, uint32_t, const char*, const char*, void*);
+bool run_reader_next(RunReader*, int, Row*);
+void select_external_sort(Statement*, Table*);
+// ========= sort end ===========
+
+// ========= write buffer start ===========
+WriteBuffer* new_write_buffer(Table*);
+void* write_buffer_cell(WriteBuffer*, uint32_t);
+uint32_t* write_buffer_key(WriteBuffer*, uint32_t);
+void* write_buffer_value(WriteBuffer*, uint32_t);
+uint32_t write_buffer_bloom_bit(uint32_t, uint32_t, uint32_t);
+void write_buffer_bloom_add(uint64_t*, uint32_t, uint32_t);
+bool write_buffer_bloom_test(uint64_t*, uint32_t, uint32_t);
+uint32_t write_buffer_find(WriteBuffer*, uint32_t);
+bool write_buffer_contains(WriteBuffer*, uint32_t);
+void write_buffer_insert(Table*, Row*);
+void write_buffer_flush(Table*);
+// ========= write buffer end ===========
+
+// ========= compression start ===========
+uint32_t page_compress(void*, void*);
+void page_decompress(void*, uint32_t, void*);
+void pager_read_compressed_header(Pager*);
+void pager_write_compressed_header(Pager*);
+void pager_write_slot(Pager*, uint32_t);
+uint64_t pager_allocate_region(Pager*, uint32_t);
+void pager_free_region(Pager*, uint64_t, uint32_t);
+int compare_slot_offsets(const void*, const void*);
+// ========= compression end ===========
+
+// ========= backup start ===========
+void pager_open_changed(Pager*);
+void pager_save_changed(Pager*, uint32_t);
+void pager_write_changed(Pager*, const char*);
+bool pager_page_changed(Pager*, uint32_t);
+void backup_table(Table*, const char*, bool);
+// ========= backup end ===========
+
+// ========= hash index start ===========
+uint32_t hash_key(uint32_t);
+uint32_t* hash_directory_global_depth(void*);
+uint32_t* hash_directory_bucket(void*, uint32_t);
+uint32_t* hash_bucket_local_depth(void*);
+uint32_t* hash_bucket_num_entries(void*);
+uint32_t* hash_bucket_key(void*, uint32_t);
+uint32_t* hash_bucket_page_num(void*, uint32_t);
+uint32_t* hash_bucket_cell_num(void*, uint32_t);
+void initialize_hash_bucket(void*, uint32_t);
+void hash_index_create(Pager*);
+uint32_t hash_index_bucket(Pager*, uint32_t);
+uint32_t hash_bucket_find(void*, uint32_t);
+bool hash_index_find(Pager*, uint32_t, uint32_t*, uint32_t*);
+void hash_index_put(Pager*, uint32_t, uint32_t, uint32_t);
+void hash_index_remove(Pager*, uint32_t);
+void hash_bucket_split(Pager*, uint32_t);
+void hash_index_update_leaf(Pager*, uint32_t, uint32_t);
+Cursor* hash_index_seek(Table*, uint32_t);
+// ========= hash index end ===========
+
+// ========= page frames start ===========
+void pager_allocate_frames(Pager*);
+void* pager_frame(Pager*, uint32_t);
+void pager_enable_direct_io(Pager*);
+// ========= page frames end ===========
+
+// ========= file header start ===========
+off_t pager_page_offset(Pager*, uint32_t);
+void file_header_init(void*, uint32_t);
+void pager_read_file_header(Pager*);
+void pager_write_file_header(Pager*);
+uint32_t pager_file_flags(Pager*);
+uint32_t pager_format_open_flags(Pager*);
+// ========= file header end ===========
+
+// ========= stats start ===========
+uint64_t now_ns();
+void stats_reset();
+void record_latency(StatementType, uint64_t);
+uint64_t latency_percentile(LatencyHistogram*, double);
+const char* statement_type_name(StatementType);
+void print_stats();
+void write_stats_json(const char*);
+// ========= stats end ===========
+
+// ========= delete start ===========
+PrepareResult prepare_delete(InputBuffer*, Statement*);
+PrepareResult prepare_update(InputBuffer*, Statement*);
+PrepareResult prepare_id_range(Statement*);
+Cursor* table_seek(Table*, uint32_t);
+ExecuteResult execute_delete(Statement*, Table*);
+ExecuteResult execute_update(Statement*, Table*);
+void leaf_node_delete(Cursor*);
+uint32_t internal_node_child_index(void*, uint32_t);
+void node_rebalance(Table*, uint32_t);
+void node_borrow(Table*, uint32_t, uint32_t, bool);
+void node_merge(Table*, uint32_t, uint32_t);
+void collapse_root(Table*);
+// ========= delete end ===========
+
+// ========= snapshot start ===========
+Snapshot* snapshot_open(Table*);
+void snapshot_close(Table*, Snapshot*);
+void snapshot_preserve(Pager*, uint32_t);
+void snapshot_command(InputBuffer*, Table*);
+void* table_page(Table*, uint32_t);
+// ========= snapshot end ===========
+
+// ========= server start ===========
+FILE* output();
+char* next_token(char*, const char*);
+void byte_buffer_append(ByteBuffer*, const void*, size_t);
+void byte_buffer_free(ByteBuffer*);
+void serve(Table*, const char*);
+void server_signals(sigset_t*);
+void server_accept(Server*);
+void server_read(Server*, Connection*);
+void server_write(Server*, Connection*);
+void server_dispatch(Server*, Connection*);
+void server_watch(Server*, Connection*);
+void server_close_if_finished(Server*, Connection*);
+void server_complete_jobs(Server*);
+void server_drop_connection(Server*, Connection*);
+void server_free_closed(Server*);
+void* server_worker_main(void*);
+void server_run_job(Server*, ServerJob*, InputBuffer*);
+int client_main(const char*);
+bool read_full(int, void*, size_t);
+bool write_full(int, const void*, size_t);
+// ========= server end ===========
+
+// ========= trace start ===========
+void trace_page(Pager*, uint32_t, uint8_t);
+void trace_close();
+void explain_statement(InputBuffer*, Table*);
+// ========= trace end ===========
+
 const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
 const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
 
@@ -300,8 +976,33 @@ const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
 // テストのため小さくしている
 const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+// 削除でこれより少なくなったノードは，兄弟ノードから借りるか併合する
+const uint32_t LEAF_NODE_MIN_CELLS = LEAF_NODE_MAX_CELLS / 2;
+const uint32_t INTERNAL_NODE_MIN_KEYS = 1;
 // ========= part10 end ===========
 
+/*
+ * Hash Index Layout
+ */
+// idからそのセルの位置 (葉のページ番号, セル番号) を引くextendible hashing
+// ディレクトリはHASH_DIRECTORY_PAGE_NUMに置き，ファイルのヘッダのFILE_FLAG_HASH_INDEXで有無を表す
+// バケットは木のページと同じようにファイルの末尾に追加する
+// ディレクトリ: | common header | global_depth | bucket page 0 | ... | bucket page 2^global_depth - 1 |
+// バケット:     | common header | local_depth | num_entries | (key, page_num, cell_num) ... |
+const uint32_t HASH_DIRECTORY_PAGE_NUM = 1;
+const uint32_t HASH_DIRECTORY_GLOBAL_DEPTH_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t HASH_DIRECTORY_BUCKETS_OFFSET = HASH_DIRECTORY_GLOBAL_DEPTH_OFFSET + sizeof(uint32_t);
+// 2^9個のページ番号までが1ページに収まる
+const uint32_t HASH_DIRECTORY_MAX_DEPTH = 9;
+const uint32_t HASH_BUCKET_LOCAL_DEPTH_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t HASH_BUCKET_NUM_ENTRIES_OFFSET = HASH_BUCKET_LOCAL_DEPTH_OFFSET + sizeof(uint32_t);
+const uint32_t HASH_BUCKET_HEADER_SIZE = HASH_BUCKET_NUM_ENTRIES_OFFSET + sizeof(uint32_t);
+const uint32_t HASH_ENTRY_KEY_OFFSET = 0;
+const uint32_t HASH_ENTRY_PAGE_NUM_OFFSET = HASH_ENTRY_KEY_OFFSET + sizeof(uint32_t);
+const uint32_t HASH_ENTRY_CELL_NUM_OFFSET = HASH_ENTRY_PAGE_NUM_OFFSET + sizeof(uint32_t);
+const uint32_t HASH_ENTRY_SIZE = HASH_ENTRY_CELL_NUM_OFFSET + sizeof(uint32_t);
+const uint32_t HASH_BUCKET_MAX_ENTRIES = (PAGE_SIZE - HASH_BUCKET_HEADER_SIZE) / HASH_ENTRY_SIZE;
+
 InputBuffer* new_input_buffer() {
     InputBuffer* input_buffer = (InputBuffer *)malloc(sizeof(InputBuffer));
     input_buffer->buffer = NULL;
@@ -336,17 +1037,107 @@ void close_input_buffer(InputBuffer* input_buffer) {
     free(input_buffer);
 }
 
+// 文を解析して実行し，結果のメッセージを表示する
+void run_statement(InputBuffer* input_buffer, Table* table) {
+    Statement statement;
+    switch (prepare_statement(input_buffer, &statement)) {
+        case (PREPARE_SUCCESS):
+            break;
+        case (PREPARE_NEGATIVE_ID):
+            fprintf(output(), "ID must be positive.\n");
+            return;
+        case (PREPARE_STRING_TOO_LONG):
+            fprintf(output(), "String is too long.\n");
+            return;
+        case (PREPARE_SYNTAX_ERROR):
+            fprintf(output(), "Syntax error. Could not parse statement.\n");
+            return;
+        case (PREPARE_UNRECOGNIZED_STATEMENT):
+            fprintf(output(), "Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
+            return;
+    }
+
+    switch (execute_statement(&statement, table)) {
+        case (EXECUTE_SUCCESS):
+            fprintf(output(), "Executed.\n");
+            break;
+        case (EXECUTE_DUPLICATE_KEY):
+            fprintf(output(), "Error: Duplicate key.\n");
+            break;
+        case (EXECUTE_TABLE_FULL):
+            fprintf(output(), "Error: Table full.\n");
+            break;
+    }
+}
+
 MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
     if (strcmp(input_buffer->buffer, ".exit") == 0) {
         db_close(table);
+        if (stats_json_path != NULL) {
+            write_stats_json(stats_json_path);
+        }
+        trace_close();
         exit(EXIT_SUCCESS);
+    } else if (strcmp(input_buffer->buffer, ".vacuum") == 0 ||
+               strncmp(input_buffer->buffer, ".vacuum ", 8) == 0) {
+        int fill_percent = VACUUM_DEFAULT_FILL_PERCENT;
+        if (input_buffer->buffer[7] == ' ') {
+            char* end;
+            fill_percent = strtol(input_buffer->buffer + 8, &end, 10);
+            if (*end != '\0' && strcmp(end, "%") != 0) {
+                fill_percent = -1;
+            }
+        }
+        if (fill_percent < (int)VACUUM_MIN_FILL_PERCENT || fill_percent > 100) {
+            printf("Error: Fill factor must be between %d and 100.\n", VACUUM_MIN_FILL_PERCENT);
+            return META_COMMAND_SUCCESS;
+        }
+        // ファイルを置き換えるとスナップショットのページ番号が意味を持たなくなる
+        if (table->snapshot != NULL) {
+            printf("Error: Close the snapshot before vacuum.\n");
+            return META_COMMAND_SUCCESS;
+        }
+        vacuum_table(table, fill_percent);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".backup") == 0 ||
+               strncmp(input_buffer->buffer, ".backup ", 8) == 0) {
+        // .backup <path> [incremental]
+        char* path = next_token(input_buffer->buffer + 7, " ");
+        char* mode = next_token(NULL, " ");
+        if (path == NULL || (mode != NULL && strcmp(mode, "incremental") != 0) ||
+            next_token(NULL, " ") != NULL) {
+            printf("Error: Usage: .backup <path> [incremental]\n");
+            return META_COMMAND_SUCCESS;
+        }
+        if (strcmp(path, table->pager->filename) == 0) {
+            printf("Error: Cannot back up a database onto itself.\n");
+            return META_COMMAND_SUCCESS;
+        }
+        backup_table(table, path, mode != NULL);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".explain ", 9) == 0) {
+        explain_statement(input_buffer, table);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".snapshot begin") == 0 ||
+               strcmp(input_buffer->buffer, ".snapshot end") == 0) {
+        snapshot_command(input_buffer, table);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+        printf("Stats:\n");
+        print_stats();
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".stats reset") == 0) {
+        stats_reset();
+        return META_COMMAND_SUCCESS;
     } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
         printf("Constants:\n");
         print_constants();
         return META_COMMAND_SUCCESS;
     } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
         printf("Tree:\n");
+        pthread_mutex_lock(&(table->pager->lock));
         print_tree(table->pager, 0, 0);
+        pthread_mutex_unlock(&(table->pager->lock));
         // print_leaf_node(get_page(table->pager, 0));
         return META_COMMAND_SUCCESS;
     } else {
@@ -356,14 +1147,17 @@ MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
 
 PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
     statement->type = STATEMENT_INSERT;
+    // 列の余りの部分が前の文の値で埋まらないように，NULで初期化しておく
+    memset(&(statement->row_to_insert), 0, sizeof(Row));
 
     // strtok(char *s1, const char *s2): split関数みたいなもん
     // 呼び出しごとにトークンのポインタを一つずつ返す
     // 2回目以降の呼び出しではs1にNULLを指定する
-    char* keyword = strtok(input_buffer->buffer, " ");
-    char* id_string = strtok(NULL, " ");
-    char* username = strtok(NULL, " ");
-    char* email = strtok(NULL, " ");
+    // next_tokenはstrtokと同じだが，途中の位置をスレッドごとに持つ
+    char* keyword = next_token(input_buffer->buffer, " ");
+    char* id_string = next_token(NULL, " ");
+    char* username = next_token(NULL, " ");
+    char* email = next_token(NULL, " ");
 
     bool valid = !(id_string == NULL || username == NULL || email == NULL);
 
@@ -400,56 +1194,363 @@ PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement)
         return prepare_insert(input_buffer, statement);
     }
     if (strncmp(input_buffer->buffer, "select", 6) == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+        // 次のようなSQLに対応
+        // select
+        // select id, email
+        return prepare_select(input_buffer, statement);
+    }
+    if (strncmp(input_buffer->buffer, "delete", 6) == 0) {
+        // 次のようなSQLに対応
+        // delete where id < 100
+        return prepare_delete(input_buffer, statement);
+    }
+    if (strncmp(input_buffer->buffer, "update", 6) == 0) {
+        // 次のようなSQLに対応
+        // update set username = foo, email = foo@bar.com where id = 1
+        return prepare_update(input_buffer, statement);
     }
     return PREPARE_UNRECOGNIZED_STATEMENT;
 }
 
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-    void* node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->num_columns = 0;
+    statement->where.op = PREDICATE_NONE;
+    statement->has_order = false;
+    statement->has_limit = false;
+
+    char* keyword = next_token(input_buffer->buffer, " ");
+    if (strcmp(keyword, "select") != 0) {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+
+    // 列はカンマかスペースで区切る
+    char* token = next_token(NULL, " ,");
+    while (token != NULL &&
+           strcmp(token, "where") != 0 &&
+           strcmp(token, "order") != 0 &&
+           strcmp(token, "limit") != 0) {
+        if (statement->num_columns >= MAX_SELECT_COLUMNS) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        Column* destination = &(statement->columns[statement->num_columns]);
+        if (strcmp(token, "*") == 0 && statement->num_columns == 0) {
+            statement->columns[0] = COLUMN_ID;
+            statement->columns[1] = COLUMN_USERNAME;
+            statement->columns[2] = COLUMN_EMAIL;
+            statement->num_columns = 3;
+        } else if (parse_column(token, destination)) {
+            statement->num_columns += 1;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        token = next_token(NULL, " ,");
+    }
+
+    if (statement->num_columns == 0) {
+        // 列の指定がなければ全ての列を出力する
+        statement->columns[0] = COLUMN_ID;
+        statement->columns[1] = COLUMN_USERNAME;
+        statement->columns[2] = COLUMN_EMAIL;
+        statement->num_columns = 3;
+    }
+
+    // where, order by, limit の順に続く
+    if (token != NULL && strcmp(token, "where") == 0) {
+        PrepareResult result = prepare_where(statement);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+        token = next_token(NULL, " ");
+    }
+
+    if (token != NULL && strcmp(token, "order") == 0) {
+        char* by = next_token(NULL, " ");
+        char* column = next_token(NULL, " ");
+        if (by == NULL || strcmp(by, "by") != 0 ||
+            column == NULL || !parse_column(column, &(statement->order_by))) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->has_order = true;
+        statement->descending = false;
+
+        token = next_token(NULL, " ");
+        if (token != NULL && (strcmp(token, "asc") == 0 || strcmp(token, "desc") == 0)) {
+            statement->descending = strcmp(token, "desc") == 0;
+            token = next_token(NULL, " ");
+        }
+    }
+
+    if (token != NULL && strcmp(token, "limit") == 0) {
+        char* limit = next_token(NULL, " ");
+        if (limit == NULL || strspn(limit, "0123456789") != strlen(limit)) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->has_limit = true;
+        statement->limit = strtoul(limit, NULL, 10);
+        token = next_token(NULL, " ");
+    }
+
+    if (token != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+bool parse_column(const char* token, Column* column) {
+    if (strcmp(token, "id") == 0) {
+        *column = COLUMN_ID;
+    } else if (strcmp(token, "username") == 0) {
+        *column = COLUMN_USERNAME;
+    } else if (strcmp(token, "email") == 0) {
+        *column = COLUMN_EMAIL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// 次のような条件に対応 (where は読み込み済み)
+// where email = foo@bar.com    : 完全一致
+// where email like foo%        : 前方一致
+// where email like %@corp.com  : 後方一致
+// where username like %stack%  : 部分一致
+PrepareResult prepare_where(Statement* statement) {
+    Predicate* where = &(statement->where);
+
+    char* column = next_token(NULL, " ");
+    char* op = next_token(NULL, " ");
+    char* value = next_token(NULL, " ");
+
+    if (column == NULL || op == NULL || value == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    // 文字列の列のみ対応
+    if (!parse_column(column, &(where->column)) || where->column == COLUMN_ID) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    size_t length = strlen(value);
+    if (strcmp(op, "=") == 0) {
+        where->op = PREDICATE_EQUAL;
+    } else if (strcmp(op, "like") == 0) {
+        bool leading = length > 0 && value[0] == '%';
+        if (leading) {
+            value++;
+            length--;
+        }
+        bool trailing = length > 0 && value[length - 1] == '%';
+        if (trailing) {
+            length--;
+        }
+
+        if (leading && trailing) {
+            where->op = PREDICATE_CONTAINS;
+        } else if (leading) {
+            where->op = PREDICATE_SUFFIX;
+        } else if (trailing) {
+            where->op = PREDICATE_PREFIX;
+        } else {
+            where->op = PREDICATE_EQUAL;
+        }
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    uint32_t max_length = where->column == COLUMN_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE;
+    if (length > max_length) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    memcpy(where->pattern, value, length);
+    where->pattern[length] = '\0';
+    where->pattern_length = length;
+
+    return PREPARE_SUCCESS;
+}
 
+ExecuteResult execute_insert(Statement* statement, Table* table) {
     Row* row_to_insert = &(statement->row_to_insert);
     uint32_t key_to_insert = row_to_insert->id;
+
+    WriteBuffer* write_buffer = table->write_buffer;
+    if (write_buffer != NULL) {
+        if (write_buffer_contains(write_buffer, key_to_insert)) {
+            return EXECUTE_DUPLICATE_KEY;
+        }
+        // 木のBloom filterに無いキーは木にも無いので，葉ノードを読まずにバッファへ入れる
+        if (!write_buffer_bloom_test(write_buffer->tree_bloom, WRITE_BUFFER_TREE_BLOOM_BITS, key_to_insert)) {
+            stats.write_buffer_tree_skips += 1;
+            write_buffer_insert(table, row_to_insert);
+            return EXECUTE_SUCCESS;
+        }
+    }
+
+    // 索引があれば，木を辿らずにバケットを一つ見るだけで重複がわかる
+    uint32_t page_num;
+    uint32_t cell_num;
+    if (table->pager->hash_index && hash_index_find(table->pager, key_to_insert, &page_num, &cell_num)) {
+        return EXECUTE_DUPLICATE_KEY;
+    }
+
     Cursor* cursor = table_find(table, key_to_insert);
 
+    // 重複の確認はキーが入るべき葉ノードで行う
+    void* node = get_page(table->pager, cursor->page_num);
+    uint32_t num_cells = (*leaf_node_num_cells(node));
     if (cursor->cell_num < num_cells) {
         uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
         if (key_at_index == key_to_insert) {
+            free(cursor);
             return EXECUTE_DUPLICATE_KEY;
         }
     }
 
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+    if (write_buffer != NULL) {
+        write_buffer_insert(table, row_to_insert);
+    } else {
+        leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+    }
 
     free(cursor);
 
     return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
+// テーブルを先頭から走査し，where句に一致した行ごとにcallbackを呼ぶ
+// callbackがfalseを返したら走査を打ち切る
+// 書き込みバッファがあれば，木とバッファをキー順にマージしながら走査する
+void scan_table(Table* table, Statement* statement, ScanCallback callback, void* context) {
     Cursor* cursor = table_start(table);
+    WriteBuffer* write_buffer = table->write_buffer;
+    // スナップショットを開いた時にバッファは木へ書き出しているので，その後の行は見えない
+    uint32_t num_buffered = (write_buffer != NULL && table->view == NULL) ? write_buffer->num_cells : 0;
+    uint32_t buffer_index = 0;
+
+    // Rowへコピーせず，葉ノードのセルから必要な列だけを直接読む
+    // where句はセル上で評価し，一致した行だけをcallbackへ渡す
+    // PAX形式の葉では，where句の列のminipageだけを先頭から順に読むことになる
+    while (!(cursor->end_of_table) || buffer_index < num_buffered) {
+        uint32_t key;
+        const char* username;
+        const char* email;
+
+        bool from_buffer = buffer_index < num_buffered;
+        if (from_buffer && !(cursor->end_of_table)) {
+            from_buffer = *write_buffer_key(write_buffer, buffer_index) < *cursor_key(cursor);
+        }
 
-    Row row;
-    while (!(cursor->end_of_table)) {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance(cursor);
+        if (from_buffer) {
+            // バッファのセルは常に行形式
+            key = *write_buffer_key(write_buffer, buffer_index);
+            void* value = write_buffer_value(write_buffer, buffer_index);
+            username = value + USERNAME_OFFSET;
+            email = value + EMAIL_OFFSET;
+            buffer_index++;
+        } else {
+            key = *cursor_key(cursor);
+            username = cursor_username(cursor);
+            email = cursor_email(cursor);
+            cursor_advance(cursor);
+        }
+
+        if (predicate_match(&(statement->where), username, email)) {
+            if (!callback(statement, key, username, email, context)) {
+                break;
+            }
+        }
     }
 
     free(cursor);
+}
+
+// 列へのポインタは計算するだけなので，idのみの場合はpayloadに触れない
+bool print_matching_row(Statement* statement, uint32_t key, const char* username, const char* email,
+                        void* context) {
+    uint32_t* num_printed = context;
+
+    print_projection(statement, key, username, email);
+    *num_printed += 1;
+
+    return !(statement->has_limit) || *num_printed < statement->limit;
+}
+
+ExecuteResult execute_select(Statement* statement, Table* table) {
+    if (statement->has_limit && statement->limit == 0) {
+        return EXECUTE_SUCCESS;
+    }
+
+    // idの昇順は走査順そのもの
+    bool scan_order = !(statement->has_order) ||
+        (statement->order_by == COLUMN_ID && !(statement->descending));
+
+    if (scan_order) {
+        uint32_t num_printed = 0;
+        scan_table(table, statement, print_matching_row, &num_printed);
+    } else if (statement->has_limit && statement->limit <= TOP_K_MAX_ROWS) {
+        select_top_k(statement, table);
+    } else {
+        select_external_sort(statement, table);
+    }
 
     return EXECUTE_SUCCESS;
 }
 
 ExecuteResult execute_statement(Statement* statement, Table* table) {
+    if (statement->type == STATEMENT_SELECT && table->snapshot != NULL) {
+        return execute_snapshot_select(statement, table);
+    }
+
+    // 書き込みスレッドとは文の単位で排他する
+    pthread_mutex_lock(&(table->pager->lock));
+    uint64_t start = now_ns();
+    ExecuteResult result = EXECUTE_SUCCESS;
+    trace.statement_type = statement->type;
+
     switch (statement->type) {
         case (STATEMENT_INSERT):
-            return execute_insert(statement, table);
+            result = execute_insert(statement, table);
+            break;
         case (STATEMENT_SELECT):
-            return execute_select(statement, table);
+            result = execute_select(statement, table);
+            break;
+        case (STATEMENT_DELETE):
+            result = execute_delete(statement, table);
+            break;
+        case (STATEMENT_UPDATE):
+            result = execute_update(statement, table);
+            break;
     }
+
+    record_latency(statement->type, now_ns() - start);
+    pthread_mutex_unlock(&(table->pager->lock));
+    return result;
+}
+
+// 退避したページは書き換わらないので，スナップショットからのselectは文のロックを取らずに実行する
+// 長い走査の間も他の文の書き込みを止めない．ページはtable_pageが一枚ずつロックを取って読む
+// viewは表の複製に設定し，同じ表で同時に実行される他の文には見せない
+ExecuteResult execute_snapshot_select(Statement* statement, Table* table) {
+    Pager* pager = table->pager;
+    pthread_mutex_lock(&(pager->lock));
+    uint64_t start = now_ns();
+    trace.statement_type = statement->type;
+    pthread_mutex_unlock(&(pager->lock));
+
+    Table view = *table;
+    view.view = table->snapshot;
+    uint64_t probes = 0;
+    search_probes = &probes;
+    ExecuteResult result = execute_select(statement, &view);
+    search_probes = &(stats.binary_search_probes);
+
+    pthread_mutex_lock(&(pager->lock));
+    stats.binary_search_probes += probes;
+    record_latency(statement->type, now_ns() - start);
+    pthread_mutex_unlock(&(pager->lock));
+    return result;
 }
 
 // destinationにはpageの要素のポインタが入る
@@ -475,177 +1576,2951 @@ void deserialize_row(void* source, Row* destination) {
     memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
 }
 
-// row_slotは次に割り当てる列のpageのメモリアドレスを返す
-// 列は複数のページに跨って存在しないほうが良い
-// あるページが割り当てられているメモリ番地の次の番地に次のページが割り当てられているとは限らないので扱いにくい
-void* cursor_value(Cursor* cursor) {
-    uint32_t page_num = cursor->page_num;
-    void* page = get_page(cursor->table->pager, page_num);
+// 別々に読んだ列から1行を組み立てる (keyはidと同じ)
+void assemble_row(Row* destination, uint32_t key, const char* username, const char* email) {
+    destination->id = key;
+    memcpy(&(destination->username), username, USERNAME_SIZE);
+    memcpy(&(destination->email), email, EMAIL_SIZE);
+}
+
+// カーソルが指すセルを1行として読み出す
+// 葉の形式によらず，行全体が必要になった時にだけ列を集める
+void cursor_row(Cursor* cursor, Row* destination) {
+    void* page = table_page(cursor->table, cursor->page_num);
 
-    return leaf_node_value(page, cursor->cell_num);
+    leaf_node_read_row(page, cursor->cell_num, destination);
 }
 
 void print_row(Row* row) {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+    fprintf(output(), "(%d, %s, %s)\n", row->id, row->username, row->email);
 }
 
-// databaseファイルを開く
-// pager構造体の初期化
-// table構造体の初期化
-Table* db_open(const char* filename) {
-    Pager* pager = pager_open(filename);
-
-    Table* table = malloc(sizeof(Table));
-    table->pager = pager;
-    table->root_page_num = 0;
-
-    if (pager->num_pages == 0) {
-        // New database file. Initialize page 0 as leaf node.
-        void* root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
-        set_node_root(root_node, true);
-    }
+// カーソルが指すセルのキー(= id)
+// キーはセルの先頭にあるので，行のデータを読まずに取得できる
+uint32_t* cursor_key(Cursor* cursor) {
+    void* page = table_page(cursor->table, cursor->page_num);
 
-    return table;
+    return leaf_node_key(page, cursor->cell_num);
 }
 
-Pager* pager_open(const char* filename) {
-    int fd = open(filename,
-        O_RDWR | O_CREAT, // O_RDWR: Read/Write モード, O_CREAT: ファイルがなければ作成する
-        S_IWUSR | S_IRUSR // S_IWUSR: ユーザに書き込み権限を与える, S_IRUSR: ユーザに読み込み権限を与える
-    );
+// カーソルが指すセルの列
+// PAX形式の葉では列のminipageの中を指すので，他の列には触れない
+char* cursor_username(Cursor* cursor) {
+    void* page = table_page(cursor->table, cursor->page_num);
 
-    if (fd == -1) {
-        printf("Unable to open file\n");
-        exit(EXIT_FAILURE);
-    }
+    return leaf_node_username(page, cursor->cell_num);
+}
 
-    // lseek(int fd, off_t offset, int whence): ファイルの読み書きオフセットの位置を変更する
-    // fd: ファイルデスクリプタ
-    // offset: whenceからのオフセット
-    // whence: オフセットの開始位置
-    // SEEK_END: ファイルの終端
-    off_t file_length = lseek(fd, 0, SEEK_END);
+char* cursor_email(Cursor* cursor) {
+    void* page = table_page(cursor->table, cursor->page_num);
 
-    Pager* pager = malloc(sizeof(Pager));
+    return leaf_node_email(page, cursor->cell_num);
+}
 
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
+// statementで指定された列だけを出力する
+// 全ての列を指定した場合はprint_rowと同じ形式になる
+void print_projection(Statement* statement, uint32_t id, const char* username, const char* email) {
+    fprintf(output(), "(");
+    for (uint32_t i = 0; i < statement->num_columns; i++) {
+        if (i > 0) {
+            fprintf(output(), ", ");
+        }
 
-    if (file_length % PAGE_SIZE != 0) {
-        printf("Db file is not a whole number of pages, Corrupt file.\n");
-        exit(EXIT_FAILURE);
+        switch (statement->columns[i]) {
+            case (COLUMN_ID):
+                fprintf(output(), "%d", id);
+                break;
+            case (COLUMN_USERNAME):
+                fprintf(output(), "%s", username);
+                break;
+            case (COLUMN_EMAIL):
+                fprintf(output(), "%s", email);
+                break;
+        }
     }
+    fprintf(output(), ")\n");
+}
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
+// 固定長の列(NUL終端)の文字列長を返す
+// SIMDで16/32バイトずつNULを探す．列の範囲外は読まない
+uint32_t field_length(const char* field, uint32_t size) {
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(field + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
     }
-
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(field + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < size; i++) {
+        if (field[i] == '\0') {
+            return i;
+        }
+    }
+    return size;
+}
+
+// 部分一致の判定
+// needleの先頭と末尾の文字が一致する位置をSIMDでまとめて探し，候補だけをmemcmpで確かめる
+bool field_contains(const char* field, uint32_t length, const char* needle, uint32_t needle_length) {
+    if (needle_length == 0) {
+        return true;
+    }
+    if (needle_length > length) {
+        return false;
+    }
+
+    uint32_t i = 0;
+    // 先頭と末尾は比較済みなので，間の文字だけを比べる
+    uint32_t middle_length = needle_length > 2 ? needle_length - 2 : 0;
+#if defined(__AVX2__)
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+    for (; i + needle_length - 1 + 32 <= length; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(field + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(field + i + needle_length - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(first, block_first),
+            _mm256_cmpeq_epi8(last, block_last)
+        ));
+        while (mask) {
+            uint32_t bit = __builtin_ctz(mask);
+            if (memcmp(field + i + bit + 1, needle + 1, middle_length) == 0) {
+                return true;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+    for (; i + needle_length - 1 + 16 <= length; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*)(field + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*)(field + i + needle_length - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(first, block_first),
+            _mm_cmpeq_epi8(last, block_last)
+        ));
+        while (mask) {
+            uint32_t bit = __builtin_ctz(mask);
+            if (memcmp(field + i + bit + 1, needle + 1, middle_length) == 0) {
+                return true;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i + needle_length <= length; i++) {
+        if (memcmp(field + i, needle, needle_length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// where句の評価
+// 列はセル上のポインタをそのまま受け取るので，Rowへのコピーは不要
+bool predicate_match(Predicate* where, const char* username, const char* email) {
+    if (where->op == PREDICATE_NONE) {
+        return true;
+    }
+
+    const char* field;
+    uint32_t length;
+    if (where->column == COLUMN_USERNAME) {
+        field = username;
+        length = field_length(username, USERNAME_SIZE);
+    } else {
+        field = email;
+        length = field_length(email, EMAIL_SIZE);
+    }
+
+    uint32_t pattern_length = where->pattern_length;
+    switch (where->op) {
+        case (PREDICATE_EQUAL):
+            return length == pattern_length && memcmp(field, where->pattern, length) == 0;
+        case (PREDICATE_PREFIX):
+            return length >= pattern_length && memcmp(field, where->pattern, pattern_length) == 0;
+        case (PREDICATE_SUFFIX):
+            return length >= pattern_length &&
+                memcmp(field + length - pattern_length, where->pattern, pattern_length) == 0;
+        case (PREDICATE_CONTAINS):
+            return field_contains(field, length, where->pattern, pattern_length);
+        default:
+            return true;
+    }
+}
+
+// order byで指定した列で比較する
+// 同じ値の行はidの昇順に並べる
+int compare_rows(Statement* statement, Row* a, Row* b) {
+    int result;
+    switch (statement->order_by) {
+        case (COLUMN_USERNAME):
+            result = strcmp(a->username, b->username);
+            break;
+        case (COLUMN_EMAIL):
+            result = strcmp(a->email, b->email);
+            break;
+        default:
+            result = (a->id > b->id) - (a->id < b->id);
+            break;
+    }
+
+    if (statement->descending) {
+        result = -result;
+    }
+    if (result == 0) {
+        result = (a->id > b->id) - (a->id < b->id);
+    }
+    return result;
+}
+
+// heap->orderを掛けることで，根に来る行を切り替える
+int heap_compare(RowHeap* heap, uint32_t i, uint32_t j) {
+    return heap->order * compare_rows(heap->statement, &(heap->entries[i].row), &(heap->entries[j].row));
+}
+
+void heap_swap(RowHeap* heap, uint32_t i, uint32_t j) {
+    SortEntry tmp = heap->entries[i];
+    heap->entries[i] = heap->entries[j];
+    heap->entries[j] = tmp;
+}
+
+void heap_sift_up(RowHeap* heap, uint32_t index) {
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (heap_compare(heap, index, parent) <= 0) {
+            break;
+        }
+        heap_swap(heap, index, parent);
+        index = parent;
+    }
+}
+
+void heap_sift_down(RowHeap* heap, uint32_t index) {
+    while (true) {
+        uint32_t left = index * 2 + 1;
+        uint32_t right = left + 1;
+        uint32_t largest = index;
+
+        if (left < heap->size && heap_compare(heap, left, largest) > 0) {
+            largest = left;
+        }
+        if (right < heap->size && heap_compare(heap, right, largest) > 0) {
+            largest = right;
+        }
+        if (largest == index) {
+            return;
+        }
+        heap_swap(heap, index, largest);
+        index = largest;
+    }
+}
+
+void heap_push(RowHeap* heap, SortEntry* entry) {
+    heap->entries[heap->size] = *entry;
+    heap->size += 1;
+    heap_sift_up(heap, heap->size - 1);
+}
+
+void heap_pop(RowHeap* heap, SortEntry* entry) {
+    *entry = heap->entries[0];
+    heap->size -= 1;
+    heap->entries[0] = heap->entries[heap->size];
+    heap_sift_down(heap, 0);
+}
+
+// order = 1 のヒープを出力順に並べ替える(ヒープソート)
+// 並べ替えた後はヒープとしては使えない
+void heap_sort(RowHeap* heap) {
+    uint32_t size = heap->size;
+
+    // 任意の並びから作れるように，先にヒープを組み直す
+    for (uint32_t i = size / 2; i > 0; i--) {
+        heap_sift_down(heap, i - 1);
+    }
+    while (heap->size > 1) {
+        heap_swap(heap, 0, heap->size - 1);
+        heap->size -= 1;
+        heap_sift_down(heap, 0);
+    }
+
+    heap->size = size;
+}
+
+// 出力順で最後の行を根に持つk行のヒープを保持する
+// 根より前に来る行が見つかったら根と入れ替える
+bool top_k_add(Statement* statement, uint32_t key, const char* username, const char* email, void* context) {
+    RowHeap* heap = context;
+    SortEntry entry;
+    assemble_row(&(entry.row), key, username, email);
+
+    if (heap->size < heap->capacity) {
+        heap_push(heap, &entry);
+    } else if (compare_rows(statement, &(entry.row), &(heap->entries[0].row)) < 0) {
+        heap->entries[0] = entry;
+        heap_sift_down(heap, 0);
+    }
+    return true;
+}
+
+void select_top_k(Statement* statement, Table* table) {
+    RowHeap heap;
+    heap.statement = statement;
+    heap.size = 0;
+    heap.capacity = statement->limit;
+    heap.order = 1;
+    heap.entries = malloc(sizeof(SortEntry) * heap.capacity);
+
+    scan_table(table, statement, top_k_add, &heap);
+
+    heap_sort(&heap);
+    for (uint32_t i = 0; i < heap.size; i++) {
+        Row* row = &(heap.entries[i].row);
+        print_projection(statement, row->id, row->username, row->email);
+    }
+
+    free(heap.entries);
+}
+
+// バッファを並べ替えて，一時ファイルの末尾にrunとして書き出す
+void sorter_spill_run(ExternalSort* sorter) {
+    RowHeap* buffer = &(sorter->buffer);
+    heap_sort(buffer);
+
+    if (sorter->file == NULL) {
+        sorter->file = tmpfile();
+        if (sorter->file == NULL) {
+            printf("Error creating sort file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (uint32_t i = 0; i < buffer->size; i++) {
+        if (fwrite(&(buffer->entries[i].row), sizeof(Row), 1, sorter->file) != 1) {
+            printf("Error writing sort file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sorter->run_lengths = realloc(sorter->run_lengths, sizeof(uint32_t) * (sorter->num_runs + 1));
+    sorter->run_lengths[sorter->num_runs] = buffer->size;
+    sorter->num_runs += 1;
+    buffer->size = 0;
+}
+
+bool sorter_add(Statement* statement, uint32_t key, const char* username, const char* email, void* context) {
+    // 条件はscan_tableが調べ済みで，並べ替えの鍵はsorterが持っている
+    (void)statement;
+    ExternalSort* sorter = context;
+    RowHeap* buffer = &(sorter->buffer);
+
+    if (buffer->size >= buffer->capacity) {
+        sorter_spill_run(sorter);
+    }
+    // ヒープの形は保たず，書き出す時にまとめて並べ替える
+    assemble_row(&(buffer->entries[buffer->size].row), key, username, email);
+    buffer->size += 1;
+    return true;
+}
+
+bool run_reader_next(RunReader* reader, int fd, Row* row) {
+    if (reader->position >= reader->num_rows) {
+        if (reader->remaining == 0) {
+            return false;
+        }
+
+        uint32_t num_rows = reader->remaining < RUN_READER_ROWS ? reader->remaining : RUN_READER_ROWS;
+        ssize_t bytes_read = pread(fd, reader->rows, sizeof(Row) * num_rows, reader->offset);
+        if (bytes_read != (ssize_t)(sizeof(Row) * num_rows)) {
+            printf("Error reading sort file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        reader->offset += bytes_read;
+        reader->remaining -= num_rows;
+        reader->num_rows = num_rows;
+        reader->position = 0;
+    }
+
+    *row = reader->rows[reader->position];
+    reader->position += 1;
+    return true;
+}
+
+// 一致した行をSORT_RUN_ROWSごとに並べ替えて一時ファイルへ書き出し，
+// 最後に各runの先頭を最小ヒープでマージしながら出力する
+// 全体が1runに収まればファイルは使わない
+void select_external_sort(Statement* statement, Table* table) {
+    ExternalSort sorter;
+    sorter.buffer.statement = statement;
+    sorter.buffer.size = 0;
+    sorter.buffer.capacity = SORT_RUN_ROWS;
+    sorter.buffer.order = 1;
+    sorter.buffer.entries = malloc(sizeof(SortEntry) * SORT_RUN_ROWS);
+    sorter.file = NULL;
+    sorter.num_runs = 0;
+    sorter.run_lengths = NULL;
+
+    scan_table(table, statement, sorter_add, &sorter);
+
+    uint32_t limit = statement->has_limit ? statement->limit : UINT32_MAX;
+    uint32_t num_printed = 0;
+
+    if (sorter.num_runs == 0) {
+        heap_sort(&(sorter.buffer));
+        for (uint32_t i = 0; i < sorter.buffer.size && num_printed < limit; i++, num_printed++) {
+            Row* row = &(sorter.buffer.entries[i].row);
+            print_projection(statement, row->id, row->username, row->email);
+        }
+        free(sorter.buffer.entries);
+        return;
+    }
+
+    if (sorter.buffer.size > 0) {
+        sorter_spill_run(&sorter);
+    }
+    if (fflush(sorter.file) != 0) {
+        printf("Error writing sort file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    free(sorter.buffer.entries);
+
+    int fd = fileno(sorter.file);
+    RunReader* readers = malloc(sizeof(RunReader) * sorter.num_runs);
+    RowHeap heap;
+    heap.statement = statement;
+    heap.size = 0;
+    heap.capacity = sorter.num_runs;
+    heap.order = -1;
+    heap.entries = malloc(sizeof(SortEntry) * sorter.num_runs);
+
+    off_t offset = 0;
+    for (uint32_t i = 0; i < sorter.num_runs; i++) {
+        readers[i].offset = offset;
+        readers[i].remaining = sorter.run_lengths[i];
+        readers[i].num_rows = 0;
+        readers[i].position = 0;
+        offset += (off_t)sizeof(Row) * sorter.run_lengths[i];
+
+        SortEntry entry;
+        entry.run = i;
+        if (run_reader_next(&(readers[i]), fd, &(entry.row))) {
+            heap_push(&heap, &entry);
+        }
+    }
+
+    while (heap.size > 0 && num_printed < limit) {
+        SortEntry entry;
+        heap_pop(&heap, &entry);
+        print_projection(statement, entry.row.id, entry.row.username, entry.row.email);
+        num_printed++;
+
+        if (run_reader_next(&(readers[entry.run]), fd, &(entry.row))) {
+            heap_push(&heap, &entry);
+        }
+    }
+
+    free(heap.entries);
+    free(readers);
+    free(sorter.run_lengths);
+    fclose(sorter.file);
+}
+
+// 木のキーのBloom filterは，開いた時の木を一度走査して作る
+WriteBuffer* new_write_buffer(Table* table) {
+    WriteBuffer* write_buffer = malloc(sizeof(WriteBuffer));
+    write_buffer->cells = malloc(LEAF_NODE_CELL_SIZE * WRITE_BUFFER_MAX_CELLS);
+    write_buffer->num_cells = 0;
+    memset(write_buffer->bloom, 0, sizeof(write_buffer->bloom));
+    memset(write_buffer->tree_bloom, 0, sizeof(write_buffer->tree_bloom));
+
+    Cursor* cursor = table_start(table);
+    while (!cursor->end_of_table) {
+        write_buffer_bloom_add(write_buffer->tree_bloom, WRITE_BUFFER_TREE_BLOOM_BITS, *cursor_key(cursor));
+        cursor_advance(cursor);
+    }
+    free(cursor);
+
+    return write_buffer;
+}
+
+void* write_buffer_cell(WriteBuffer* write_buffer, uint32_t cell_num) {
+    return write_buffer->cells + cell_num * LEAF_NODE_CELL_SIZE;
+}
+
+uint32_t* write_buffer_key(WriteBuffer* write_buffer, uint32_t cell_num) {
+    return write_buffer_cell(write_buffer, cell_num) + LEAF_NODE_KEY_OFFSET;
+}
+
+void* write_buffer_value(WriteBuffer* write_buffer, uint32_t cell_num) {
+    return write_buffer_cell(write_buffer, cell_num) + LEAF_NODE_VALUE_OFFSET;
+}
+
+// Bloom filterで使うi番目のビット位置
+// 2つのハッシュを組み合わせてk個の位置を作る(double hashing)
+uint32_t write_buffer_bloom_bit(uint32_t key, uint32_t i, uint32_t num_bits) {
+    uint32_t h1 = key * 0x9E3779B1;
+    uint32_t h2 = ((key ^ (key >> 16)) * 0x85EBCA6B) | 1;
+    return (h1 + i * h2) % num_bits;
+}
+
+void write_buffer_bloom_add(uint64_t* bloom, uint32_t num_bits, uint32_t key) {
+    for (uint32_t i = 0; i < 3; i++) {
+        uint32_t bit = write_buffer_bloom_bit(key, i, num_bits);
+        bloom[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+// falseならkeyは確実に含まれていない
+bool write_buffer_bloom_test(uint64_t* bloom, uint32_t num_bits, uint32_t key) {
+    for (uint32_t i = 0; i < 3; i++) {
+        uint32_t bit = write_buffer_bloom_bit(key, i, num_bits);
+        if (!(bloom[bit / 64] & (1ULL << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// keyが入るべき位置を二分探索で返す
+uint32_t write_buffer_find(WriteBuffer* write_buffer, uint32_t key) {
+    uint32_t min_index = 0;
+    uint32_t one_past_max_index = write_buffer->num_cells;
+
+    while (one_past_max_index != min_index) {
+        uint32_t index = (min_index + one_past_max_index) / 2;
+        uint32_t key_at_index = *write_buffer_key(write_buffer, index);
+
+        if (key == key_at_index) {
+            return index;
+        }
+        if (key < key_at_index) {
+            one_past_max_index = index;
+        } else {
+            min_index = index + 1;
+        }
+    }
+
+    return min_index;
+}
+
+bool write_buffer_contains(WriteBuffer* write_buffer, uint32_t key) {
+    if (!write_buffer_bloom_test(write_buffer->bloom, WRITE_BUFFER_BLOOM_BITS, key)) {
+        return false;
+    }
+
+    uint32_t index = write_buffer_find(write_buffer, key);
+    return index < write_buffer->num_cells &&
+        *write_buffer_key(write_buffer, index) == key;
+}
+
+// 重複の確認は呼び出し側で済んでいる前提
+void write_buffer_insert(Table* table, Row* row) {
+    WriteBuffer* write_buffer = table->write_buffer;
+    uint32_t index = write_buffer_find(write_buffer, row->id);
+
+    if (index < write_buffer->num_cells) {
+        // Make room for cell
+        memmove(
+            write_buffer_cell(write_buffer, index + 1),
+            write_buffer_cell(write_buffer, index),
+            (write_buffer->num_cells - index) * LEAF_NODE_CELL_SIZE
+        );
+    }
+
+    *write_buffer_key(write_buffer, index) = row->id;
+    serialize_row(row, write_buffer_value(write_buffer, index));
+    write_buffer->num_cells += 1;
+    write_buffer_bloom_add(write_buffer->bloom, WRITE_BUFFER_BLOOM_BITS, row->id);
+
+    if (write_buffer->num_cells >= WRITE_BUFFER_MAX_CELLS) {
+        write_buffer_flush(table);
+    }
+}
+
+// バッファの行をキー順に木へ書き出す
+// 続くキーは同じ葉ノードに入ることが多いので，同じページに書き込みがまとまる
+void write_buffer_flush(Table* table) {
+    WriteBuffer* write_buffer = table->write_buffer;
+
+    Row row;
+    for (uint32_t i = 0; i < write_buffer->num_cells; i++) {
+        deserialize_row(write_buffer_value(write_buffer, i), &row);
+
+        Cursor* cursor = table_find(table, row.id);
+        leaf_node_insert(cursor, row.id, &row);
+        free(cursor);
+        write_buffer_bloom_add(write_buffer->tree_bloom, WRITE_BUFFER_TREE_BLOOM_BITS, row.id);
+    }
+
+    write_buffer->num_cells = 0;
+    memset(write_buffer->bloom, 0, sizeof(write_buffer->bloom));
+}
+
+// databaseファイルを開く
+// pager構造体の初期化
+// table構造体の初期化
+Table* db_open(const char* filename, uint32_t flags) {
+    Pager* pager = pager_open(filename, flags);
+
+    Table* table = malloc(sizeof(Table));
+    table->pager = pager;
+    table->root_page_num = 0;
+    table->write_buffer = NULL;
+    table->snapshot = NULL;
+    table->view = NULL;
+
+    if (pager->num_pages == 0) {
+        // New database file. Initialize page 0 as leaf node.
+        void* root_node = get_page(pager, 0);
+        pager_mark_dirty(pager, 0);
+        initialize_leaf_node(root_node, pager->leaf_layout);
+        set_node_root(root_node, true);
+        if (pager->hash_index) {
+            hash_index_create(pager);
+        }
+    }
+
+    return table;
+}
+
+Pager* pager_open(const char* filename, uint32_t flags) {
+    int fd = open(filename,
+        O_RDWR | O_CREAT, // O_RDWR: Read/Write モード, O_CREAT: ファイルがなければ作成する
+        S_IWUSR | S_IRUSR // S_IWUSR: ユーザに書き込み権限を与える, S_IRUSR: ユーザに読み込み権限を与える
+    );
+
+    if (fd == -1) {
+        printf("Unable to open file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // lseek(int fd, off_t offset, int whence): ファイルの読み書きオフセットの位置を変更する
+    // fd: ファイルデスクリプタ
+    // offset: whenceからのオフセット
+    // whence: オフセットの開始位置
+    // SEEK_END: ファイルの終端
+    off_t file_length = lseek(fd, 0, SEEK_END);
+
+    Pager* pager = malloc(sizeof(Pager));
+
+    pager->file_descriptor = fd;
+    pager->file_length = file_length;
+    pager->format_version = FILE_FORMAT_VERSION;
+    pager->header_size = 0;
+    pager->num_pages = 0;
+    pager->compressed = false;
+    pager->flags = flags;
+    pager->direct_io = false;
+    pager->leaf_layout = LEAF_LAYOUT_ROW;
+    pager->hash_index = false;
+    pager->num_dirty = 0;
+    pager->snapshots = NULL;
+    pager->writer_running = false;
+    pager->writer_stopping = false;
+    pthread_mutex_init(&(pager->lock), NULL);
+    pthread_cond_init(&(pager->writer_wakeup), NULL);
+    pager->filename = strdup(filename);
+    pager->hot_path = malloc(strlen(filename) + sizeof("-hot"));
+    sprintf(pager->hot_path, "%s-hot", filename);
+
+    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+        pager->pages[i] = NULL;
+        pager->dirty[i] = false;
+        pager->access_counts[i] = 0;
+    }
+    pager_allocate_frames(pager);
+    pager_open_changed(pager);
+
+    // ファイルの先頭のmagicで形式を判別する
+    // version 1の通常のファイルの先頭はノードの種類(0か1)なので，どのmagicとも一致しない
+    char magic[FILE_MAGIC_SIZE];
+    bool has_magic = file_length >= FILE_MAGIC_SIZE &&
+        pread(fd, magic, FILE_MAGIC_SIZE, 0) == FILE_MAGIC_SIZE;
+    if (has_magic && memcmp(magic, FILE_MAGIC, FILE_MAGIC_SIZE) == 0) {
+        pager_read_file_header(pager);
+    } else if (has_magic && memcmp(magic, LEGACY_COMPRESSED_FILE_MAGIC, FILE_MAGIC_SIZE) == 0) {
+        pager->format_version = FILE_LEGACY_VERSION;
+        pager_read_compressed_header(pager);
+    } else if (file_length != 0) {
+        pager->format_version = FILE_LEGACY_VERSION;
+    }
+
+    if ((flags & DB_OPEN_COMPRESSED) && !pager->compressed) {
+        if (file_length != 0) {
+            printf("Compression can only be enabled on a new database file.\n");
+            exit(EXIT_FAILURE);
+        }
+        pager->compressed = true;
+        pager->header_size = COMPRESSED_HEADER_SIZE;
+        pager->file_end = COMPRESSED_HEADER_SIZE;
+        memset(pager->slots, 0, sizeof(pager->slots));
+        pager->num_free_regions = 0;
+    }
+
+    // 既にある葉の形式は変えられない
+    if ((flags & DB_OPEN_PAX_LEAVES) && pager->leaf_layout != LEAF_LAYOUT_PAX) {
+        if (file_length != 0) {
+            printf("PAX layout can only be enabled on a new database file.\n");
+            exit(EXIT_FAILURE);
+        }
+        pager->leaf_layout = LEAF_LAYOUT_PAX;
+    }
+    if ((flags & DB_OPEN_HASH_INDEX) && !pager->hash_index) {
+        if (file_length != 0) {
+            printf("Hash index can only be enabled on a new database file.\n");
+            exit(EXIT_FAILURE);
+        }
+        pager->hash_index = true;
+    }
+
+    // 圧縮したページは可変長で，O_DIRECTの境界の制約を満たせない
+    if ((flags & DB_OPEN_DIRECT_IO) && pager->compressed) {
+        printf("Direct I/O cannot be used with a compressed database file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pager->compressed && file_length == 0) {
+        // slotは確保するたびにヘッダへ書き込むので，先にヘッダを作っておく
+        pager_write_compressed_header(pager);
+        return pager;
+    }
+
+    if (file_length == 0) {
+        // 新しいファイルは最新の形式で作る
+        pager->header_size = FILE_HEADER_SIZE;
+        pager_write_file_header(pager);
+        pager->file_length = FILE_HEADER_SIZE;
+        if (flags & DB_OPEN_DIRECT_IO) {
+            pager_enable_direct_io(pager);
+        }
+        return pager;
+    }
+
+    if (!pager->compressed) {
+        if (pager->file_length < pager->header_size ||
+            (pager->file_length - pager->header_size) % PAGE_SIZE != 0) {
+            printf("Db file is not a whole number of pages, Corrupt file.\n");
+            exit(EXIT_FAILURE);
+        }
+        pager->num_pages = (pager->file_length - pager->header_size) / PAGE_SIZE;
+        // ヘッダの読み込みが終わってから切り替える (以降の読み書きはページ単位だけ)
+        if (flags & DB_OPEN_DIRECT_IO) {
+            pager_enable_direct_io(pager);
+        }
+    }
+
+    pager_preload_hot_pages(pager);
     return pager;
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-    if (page_num > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);
+void* get_page(Pager* pager, uint32_t page_num) {
+    if (page_num >= TABLE_MAX_PAGES) {
+        printf("Tried to fetch page number out of bounds. %d >= %d\n", page_num, TABLE_MAX_PAGES);
+        exit(EXIT_FAILURE);
+    }
+
+    stats.page_requests += 1;
+    uint8_t trace_flags = 0;
+
+    if (pager->pages[page_num] == NULL) {
+        stats.page_misses += 1;
+        if (page_num >= pager->num_pages) {
+            trace_flags |= TRACE_PAGE_NEW;
+        }
+
+        // キャッシュヒットしない場合, ファイルからページの枠にロードする
+        // 枠は0で初期化されているので，新しいページの使っていない部分は0になる(圧縮しやすくなる)
+        void* page = pager_frame(pager, page_num);
+        pager_read_page(pager, page_num, page);
+
+        pager->pages[page_num] = page;
+
+        if (page_num >= pager->num_pages) {
+            pager->num_pages = page_num + 1;
+            // 新しいページはファイルにまだ存在しないので必ず書き出す
+            pager_mark_dirty(pager, page_num);
+        }
+    } else {
+        stats.page_hits += 1;
+        trace_flags |= TRACE_PAGE_HIT;
+    }
+    pager->access_counts[page_num] += 1;
+
+    if (trace.explaining || trace.file != NULL) {
+        trace_page(pager, page_num, trace_flags);
+    }
+
+    return pager->pages[page_num];
+}
+
+void db_close(Table* table) {
+    Pager* pager = table->pager;
+
+    // 以降は単一スレッドで扱う
+    pager_stop_writer(pager);
+
+    if (table->snapshot != NULL) {
+        snapshot_close(table, table->snapshot);
+    }
+
+    if (table->write_buffer != NULL) {
+        write_buffer_flush(table);
+        free(table->write_buffer->cells);
+        free(table->write_buffer);
+    }
+
+    pager_close(pager);
+    free(table);
+}
+
+// キャッシュのダーティページを書き出してファイルを閉じる
+void pager_close(Pager* pager) {
+    pager_stop_writer(pager);
+
+    pager_write_hot_pages(pager);
+
+    // 書き込みスレッドが書き出していないページだけが残っている
+    for (uint32_t i = 0; i < pager->num_pages; i++) {
+        if (pager->pages[i] == NULL) {
+            continue;
+        }
+
+        if (pager->dirty[i]) {
+            pager_flush(pager, i);
+        }
+        pager->pages[i] = NULL;
+    }
+
+    if (pager->compressed) {
+        pager_write_compressed_header(pager);
+    }
+
+    // ページの一部をファイルの終端に書き込む可能性がある
+    // b-treeの実装後は不要になる
+    // uint32_t num_additional_rows = table->num_rows % ROWS_PER_PAGE;
+    // if (num_additional_rows > 0) {
+    //     uint32_t page_num = num_full_pages;
+    //     if (pager->pages[page_num] != NULL) {
+    //         pager_flush(pager, page_num, num_additional_rows * ROW_SIZE);
+    //         free(pager->pages[page_num]);
+
+    //         pager->pages[page_num] = NULL;
+    //     }
+    // }
+
+    int result = close(pager->file_descriptor);
+    if (result == -1) {
+        printf("Error closing db file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    munmap(pager->frames_mapping, pager->frames_mapping_size);
+
+    pthread_mutex_destroy(&(pager->lock));
+    pthread_cond_destroy(&(pager->writer_wakeup));
+    if (pager->changed_fd != -1) {
+        close(pager->changed_fd);
+    }
+    free(pager->changed_path);
+    free(pager->last_backup_path);
+    free(pager->hot_path);
+    free(pager->filename);
+    free(pager);
+}
+
+void pager_flush(Pager* pager, uint32_t page_num) {
+    if (pager->pages[page_num] == NULL) {
+        printf("Tried to flush null page.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t start = now_ns();
+    void* data = pager->pages[page_num];
+    uint32_t length = PAGE_SIZE;
+    off_t position = pager_page_offset(pager, page_num);
+
+    char compressed[COMPRESSED_PAGE_MAX_SIZE];
+    PageSlot old_slot = {0};
+    bool slot_moved = false;
+    if (pager->compressed) {
+        data = compressed;
+        length = page_compress(pager->pages[page_num], compressed);
+
+        // 今の領域に収まらなければ新しい領域を確保する
+        // 古い領域は新しい領域とslotを書き込んだ後で空き領域に戻す
+        PageSlot* slot = &(pager->slots[page_num]);
+        old_slot = *slot;
+        if (length > slot->capacity) {
+            slot->capacity = (length + COMPRESSED_SLOT_ALIGNMENT - 1) /
+                COMPRESSED_SLOT_ALIGNMENT * COMPRESSED_SLOT_ALIGNMENT;
+            slot->offset = pager_allocate_region(pager, slot->capacity);
+            slot_moved = true;
+        }
+        slot->length = length;
+        position = slot->offset;
+    }
+
+    // 書き込みスレッドからも呼ばれるので，ファイルのオフセットを共有しないpwriteを使う
+    ssize_t bytes_written =
+        pwrite(pager->file_descriptor, data, length, position);
+
+    if (bytes_written == -1) {
+        printf("error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    // 閉じる前に落ちてもページを辿れるように，slotが変わったらすぐにヘッダへ書く
+    // 展開にはlengthがちょうど必要なので，移した時だけでなくlengthが変わった時も書く
+    // 移した時はページを書いてからslotを書くので，その間に落ちても古い領域の内容が残る
+    if (pager->compressed && (slot_moved || old_slot.length != length)) {
+        pager_write_slot(pager, page_num);
+    }
+    if (slot_moved && old_slot.capacity > 0) {
+        pager_free_region(pager, old_slot.offset, old_slot.capacity);
+    }
+
+    if (pager->dirty[page_num]) {
+        pager->dirty[page_num] = false;
+        pager->num_dirty -= 1;
+    }
+    pager_save_changed(pager, page_num);
+
+    stats.pages_written += 1;
+    stats.bytes_written += bytes_written;
+    stats.flush_ns += now_ns() - start;
+}
+
+/*
+ * Background Writer
+ */
+// ページを変更する前に呼ぶ
+void pager_mark_dirty(Pager* pager, uint32_t page_num) {
+    if (pager->snapshots != NULL) {
+        snapshot_preserve(pager, page_num);
+    }
+    // 前回のバックアップの後に変更した (dirtyは前回のバックアップより前の変更でも立ったまま)
+    pager->changed[page_num / 8] |= 1 << (page_num % 8);
+
+    if (pager->dirty[page_num]) {
+        return;
+    }
+
+    pager->dirty[page_num] = true;
+    pager->num_dirty += 1;
+
+    if (pager->writer_running && pager_dirty_over_threshold(pager)) {
+        pthread_cond_signal(&(pager->writer_wakeup));
+    }
+}
+
+bool pager_dirty_over_threshold(Pager* pager) {
+    return pager->num_dirty * 100 >= TABLE_MAX_PAGES * WRITER_DIRTY_THRESHOLD_PERCENT;
+}
+
+// ダーティページをページ番号順に1ページずつ書き出す
+// ページごとにロックを取り直すので，文の実行を長く止めることはない
+void* pager_writer_main(void* argument) {
+    Pager* pager = argument;
+
+    pthread_mutex_lock(&(pager->lock));
+    while (!pager->writer_stopping) {
+        if (!pager_dirty_over_threshold(pager)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)WRITER_INTERVAL_MS * 1000000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&(pager->writer_wakeup), &(pager->lock), &deadline);
+        }
+
+        for (uint32_t i = 0; i < pager->num_pages && !pager->writer_stopping; i++) {
+            if (pager->pages[i] == NULL || !pager->dirty[i]) {
+                continue;
+            }
+
+            pager_flush(pager, i);
+            stats.background_pages_written += 1;
+
+            pthread_mutex_unlock(&(pager->lock));
+            pthread_mutex_lock(&(pager->lock));
+        }
+    }
+    pthread_mutex_unlock(&(pager->lock));
+
+    return NULL;
+}
+
+void pager_start_writer(Pager* pager) {
+    pager->writer_stopping = false;
+    if (pthread_create(&(pager->writer), NULL, pager_writer_main, pager) != 0) {
+        printf("Unable to start background writer\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->writer_running = true;
+}
+
+void pager_stop_writer(Pager* pager) {
+    if (!pager->writer_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&(pager->lock));
+    pager->writer_stopping = true;
+    pthread_cond_signal(&(pager->writer_wakeup));
+    pthread_mutex_unlock(&(pager->lock));
+
+    pthread_join(pager->writer, NULL);
+    pager->writer_running = false;
+}
+
+/*
+ * Snapshot
+ */
+// 今の木の内容を見るスナップショットを開く
+// 書き込みバッファの行も含めるため，先に木へ書き出しておく
+Snapshot* snapshot_open(Table* table) {
+    Pager* pager = table->pager;
+    if (table->write_buffer != NULL) {
+        write_buffer_flush(table);
+    }
+
+    Snapshot* snapshot = calloc(1, sizeof(Snapshot));
+    snapshot->num_pages = pager->num_pages;
+    snapshot->next = pager->snapshots;
+    pager->snapshots = snapshot;
+
+    return snapshot;
+}
+
+void snapshot_close(Table* table, Snapshot* snapshot) {
+    Pager* pager = table->pager;
+    Snapshot** link = &(pager->snapshots);
+    while (*link != snapshot) {
+        link = &((*link)->next);
+    }
+    *link = snapshot->next;
+
+    for (uint32_t i = 0; i < snapshot->num_pages; i++) {
+        free(snapshot->pages[i]);
+    }
+    free(snapshot);
+}
+
+// 開いているスナップショットが変更前のページを読めるように，内容を退避する
+// スナップショットごとに，最初に変更される時に一度だけ複製する
+// まだ読み込まれていないページもあるので，get_pageで読む
+void snapshot_preserve(Pager* pager, uint32_t page_num) {
+    for (Snapshot* snapshot = pager->snapshots; snapshot != NULL; snapshot = snapshot->next) {
+        if (page_num >= snapshot->num_pages || snapshot->pages[page_num] != NULL) {
+            continue;
+        }
+
+        void* copy = malloc(PAGE_SIZE);
+        memcpy(copy, get_page(pager, page_num), PAGE_SIZE);
+        snapshot->pages[page_num] = copy;
+        stats.snapshot_pages_copied += 1;
+    }
+}
+
+// 木を読む時はこちらを使う
+// table->viewが設定されていれば，スナップショットを開いた時点のページを返す
+// その読み出しは文のロックの外で行うので，ここでページごとにロックを取る
+// まだ退避していないページはここで複製し，以後の書き込みと関係なく読めるようにする
+void* table_page(Table* table, uint32_t page_num) {
+    Snapshot* view = table->view;
+    if (view == NULL || page_num >= view->num_pages) {
+        return get_page(table->pager, page_num);
+    }
+
+    Pager* pager = table->pager;
+    pthread_mutex_lock(&(pager->lock));
+    void* page = get_page(pager, page_num);
+    if (view->pages[page_num] == NULL) {
+        // 変更されていないページなので，今の内容が開いた時点の内容
+        // (snapshot_pages_copiedには数えない)
+        void* copy = malloc(PAGE_SIZE);
+        memcpy(copy, page, PAGE_SIZE);
+        view->pages[page_num] = copy;
+    }
+    page = view->pages[page_num];
+    pthread_mutex_unlock(&(pager->lock));
+
+    return page;
+}
+
+// .snapshot begin と .snapshot end
+// サーバーでは接続ごとのスナップショットを設定した表の複製が渡される
+void snapshot_command(InputBuffer* input_buffer, Table* table) {
+    if (strcmp(input_buffer->buffer, ".snapshot begin") == 0) {
+        if (table->snapshot != NULL) {
+            fprintf(output(), "Error: Snapshot already open.\n");
+            return;
+        }
+        pthread_mutex_lock(&(table->pager->lock));
+        table->snapshot = snapshot_open(table);
+        pthread_mutex_unlock(&(table->pager->lock));
+    } else {
+        if (table->snapshot == NULL) {
+            fprintf(output(), "Error: No snapshot open.\n");
+            return;
+        }
+        pthread_mutex_lock(&(table->pager->lock));
+        snapshot_close(table, table->snapshot);
+        table->snapshot = NULL;
+        pthread_mutex_unlock(&(table->pager->lock));
+    }
+}
+
+/*
+ * Vacuum
+ */
+// 葉の連結リストを辿り，ファイル上で次のページにない葉への移動を数える
+void print_fragmentation(const char* label, Table* table) {
+    Pager* pager = table->pager;
+    Cursor* cursor = table_find(table, 0);
+    uint32_t page_num = cursor->page_num;
+    free(cursor);
+
+    uint32_t num_leaves = 1;
+    uint32_t out_of_order = 0;
+    while (true) {
+        uint32_t next_page_num = *leaf_node_next_leaf(get_page(pager, page_num));
+        if (next_page_num == 0) {
+            break;
+        }
+        if (next_page_num != page_num + 1) {
+            out_of_order++;
+        }
+        num_leaves++;
+        page_num = next_page_num;
+    }
+
+    uint32_t hops = num_leaves - 1;
+    printf("%s: %d pages, %d leaves, %d of %d leaf hops out of order (%.1f%%)\n",
+        label, pager->num_pages, num_leaves, out_of_order, hops,
+        hops == 0 ? 0.0 : 100.0 * out_of_order / hops);
+}
+
+// 木を新しいファイルに作り直し，元のファイルと置き換える
+// 葉はページ1からキー順に連続して並べ，中間ノードをその後ろに置く (根は常にページ0)
+// 各ノードにはfill_percentの分だけ詰め，残りを後の挿入のために空けておく
+void vacuum_table(Table* table, uint32_t fill_percent) {
+    Pager* pager = table->pager;
+    bool writer_was_running = pager->writer_running;
+    pager_stop_writer(pager);
+    if (table->write_buffer != NULL) {
+        write_buffer_flush(table);
+    }
+
+    print_fragmentation("Before", table);
+
+    uint32_t cells_per_leaf = LEAF_NODE_MAX_CELLS * fill_percent / 100;
+    if (cells_per_leaf == 0) {
+        cells_per_leaf = 1;
+    }
+    uint32_t children_per_node = (INTERNAL_NODE_MAX_CELLS + 1) * fill_percent / 100;
+    if (children_per_node < 2) {
+        children_per_node = 2;
+    }
+
+    uint32_t num_rows = 0;
+    Cursor* cursor = table_start(table);
+    while (!cursor->end_of_table) {
+        num_rows++;
+        cursor_advance(cursor);
+    }
+    free(cursor);
+
+    uint32_t num_leaves = (num_rows + cells_per_leaf - 1) / cells_per_leaf;
+    if (num_leaves == 0) {
+        num_leaves = 1;
+    }
+    // 葉が一つならそのまま根になる
+    // 索引のディレクトリのページは空けておき，バケットは木の後ろに作る
+    uint32_t first_free_page_num = pager->hash_index ? HASH_DIRECTORY_PAGE_NUM + 1 : 1;
+    uint32_t first_leaf = (num_leaves == 1) ? 0 : first_free_page_num;
+    if (first_leaf + num_leaves > TABLE_MAX_PAGES) {
+        printf("Error: Table full.\n");
+        if (writer_was_running) {
+            pager_start_writer(pager);
+        }
+        return;
+    }
+
+    char* filename = strdup(pager->filename);
+    char* vacuum_path = malloc(strlen(filename) + sizeof("-vacuum"));
+    sprintf(vacuum_path, "%s-vacuum", filename);
+    unlink(vacuum_path);
+    Pager* new_pager = pager_open(vacuum_path, pager_format_open_flags(pager));
+
+    // 次の段で親を作るための子の一覧
+    uint32_t child_pages[TABLE_MAX_PAGES];
+    uint32_t child_max_keys[TABLE_MAX_PAGES];
+
+    cursor = table_start(table);
+    for (uint32_t leaf = 0; leaf < num_leaves; leaf++) {
+        uint32_t page_num = first_leaf + leaf;
+        void* node = get_page(new_pager, page_num);
+        pager_mark_dirty(new_pager, page_num);
+        initialize_leaf_node(node, new_pager->leaf_layout);
+        set_node_root(node, num_leaves == 1);
+        *leaf_node_next_leaf(node) = (leaf + 1 < num_leaves) ? page_num + 1 : 0;
+
+        uint32_t num_cells = 0;
+        while (num_cells < cells_per_leaf && !cursor->end_of_table) {
+            Row row;
+            cursor_row(cursor, &row);
+            leaf_node_write_cell(node, num_cells, *cursor_key(cursor), &row);
+            num_cells++;
+            cursor_advance(cursor);
+        }
+        *leaf_node_num_cells(node) = num_cells;
+
+        child_pages[leaf] = page_num;
+        child_max_keys[leaf] = (num_cells > 0) ? *leaf_node_key(node, num_cells - 1) : 0;
+    }
+    free(cursor);
+
+    // 下の段から順に中間ノードを作り，ノードが一つになった段を根にする
+    uint32_t num_children = num_leaves;
+    uint32_t next_page_num = first_leaf + num_leaves;
+    while (num_children > 1) {
+        uint32_t num_nodes = (num_children + children_per_node - 1) / children_per_node;
+        // どのノードも2つ以上の子を持つようにする
+        if (num_nodes > num_children / 2) {
+            num_nodes = num_children / 2;
+        }
+        uint32_t child = 0;
+        for (uint32_t n = 0; n < num_nodes; n++) {
+            // 子を均等に分ける
+            uint32_t count = num_children / num_nodes + (n < num_children % num_nodes ? 1 : 0);
+            uint32_t page_num = (num_nodes == 1) ? 0 : next_page_num++;
+            if (page_num >= TABLE_MAX_PAGES) {
+                printf("Error: Table full.\n");
+                exit(EXIT_FAILURE);
+            }
+            void* node = get_page(new_pager, page_num);
+            pager_mark_dirty(new_pager, page_num);
+            initialize_internal_node(node);
+            set_node_root(node, num_nodes == 1);
+            *internal_node_num_keys(node) = count - 1;
+
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t child_page_num = child_pages[child + i];
+                pager_mark_dirty(new_pager, child_page_num);
+                *node_parent(get_page(new_pager, child_page_num)) = page_num;
+                if (i + 1 < count) {
+                    *internal_node_child(node, i) = child_page_num;
+                    *internal_node_key(node, i) = child_max_keys[child + i];
+                } else {
+                    *internal_node_right_child(node) = child_page_num;
+                }
+            }
+
+            // n <= child なので，まだ読んでいない子を上書きすることはない
+            uint32_t max_key = child_max_keys[child + count - 1];
+            child_pages[n] = page_num;
+            child_max_keys[n] = max_key;
+            child += count;
+        }
+        num_children = num_nodes;
+    }
+
+    if (new_pager->hash_index) {
+        hash_index_create(new_pager);
+        for (uint32_t leaf = 0; leaf < num_leaves; leaf++) {
+            hash_index_update_leaf(new_pager, first_leaf + leaf, 0);
+        }
+    }
+
+    pager_close(new_pager);
+    // 置き換える前に新しいファイルをディスクに書き出しておく
+    int fd = open(vacuum_path, O_RDONLY);
+    if (fd == -1 || fsync(fd) == -1) {
+        printf("Error syncing vacuum file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    // renameは同じファイルシステム内ならアトミックに置き換わる
+    // 新しいファイルは最新の形式で作られるので，古い形式のファイルはここで変換される
+    uint32_t old_format_version = pager->format_version;
+    uint32_t new_pager_flags = pager->flags & ~(DB_OPEN_COMPRESSED | DB_OPEN_PAX_LEAVES | DB_OPEN_HASH_INDEX);
+    pager_close(pager);
+    if (rename(vacuum_path, filename) == -1) {
+        printf("Error replacing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    // 古いページ番号の記録は役に立たないので捨てる
+    char* hot_path = malloc(strlen(vacuum_path) + sizeof("-hot"));
+    sprintf(hot_path, "%s-hot", vacuum_path);
+    unlink(hot_path);
+    sprintf(hot_path, "%s-hot", filename);
+    unlink(hot_path);
+    free(hot_path);
+    // ページ番号が変わるので，次のバックアップは全体を写す
+    char* changed_path = malloc(strlen(filename) + sizeof("-changed"));
+    sprintf(changed_path, "%s-changed", filename);
+    unlink(changed_path);
+    free(changed_path);
+
+    table->pager = pager_open(filename, new_pager_flags);
+    if (writer_was_running) {
+        pager_start_writer(table->pager);
+    }
+
+    printf("Vacuumed %d rows into %d leaves (fill %d%%).\n", num_rows, num_leaves, fill_percent);
+    if (old_format_version != table->pager->format_version) {
+        printf("Converted file format from version %d to %d.\n",
+               old_format_version, table->pager->format_version);
+    }
+    print_fragmentation("After", table);
+
+    free(vacuum_path);
+    free(filename);
+}
+
+/*
+ * Warm Start
+ */
+// ファイルからページを読み込む
+// ファイルにまだ存在しないページは何もしない (0のまま)
+void pager_read_page(Pager* pager, uint32_t page_num, void* page) {
+    uint64_t num_pages = (pager->file_length - pager->header_size) / PAGE_SIZE;
+
+    // ファイルの最後にページの一部を保存する可能性あり
+    if ((pager->file_length - pager->header_size) % PAGE_SIZE) {
+        num_pages += 1;
+    }
+
+    if (pager->compressed) {
+        // キャッシュには展開したページを置く
+        PageSlot* slot = &(pager->slots[page_num]);
+        if (slot->length > 0) {
+            char compressed[COMPRESSED_PAGE_MAX_SIZE];
+            ssize_t bytes_read = pread(pager->file_descriptor, compressed, slot->length, slot->offset);
+            if (bytes_read != slot->length) {
+                printf("Error reading file: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            page_decompress(compressed, slot->length, page);
+            stats.pages_read += 1;
+            stats.bytes_read += bytes_read;
+        }
+    } else if (page_num <= num_pages) {
+        // pread(int fd, void* buf, size_t count, off_t offset): 指定した位置から読み込む
+        // fd: ファイルディスクリプタ, buf: 読み込み先バッファ, count: 読み込むバイト数
+        // 位置はoff_t(64bit)で渡すので，4GiBを超える位置でも溢れない
+        ssize_t bytes_read = pread(pager->file_descriptor, page, PAGE_SIZE, pager_page_offset(pager, page_num));
+        if (bytes_read == -1) {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        stats.pages_read += 1;
+        stats.bytes_read += bytes_read;
+    }
+}
+
+// キャッシュにあるページの番号とアクセス回数をhotファイルに記録する
+void pager_write_hot_pages(Pager* pager) {
+    char buffer[HOT_HEADER_SIZE + TABLE_MAX_PAGES * HOT_ENTRY_SIZE];
+    uint32_t num_entries = 0;
+
+    for (uint32_t i = 0; i < pager->num_pages; i++) {
+        if (pager->pages[i] == NULL || pager->access_counts[i] == 0) {
+            continue;
+        }
+        uint32_t* entry = (uint32_t*)(buffer + HOT_HEADER_SIZE + num_entries * HOT_ENTRY_SIZE);
+        entry[0] = i;
+        entry[1] = pager->access_counts[i];
+        num_entries++;
+    }
+    memcpy(buffer, HOT_FILE_MAGIC, HOT_MAGIC_SIZE);
+    memcpy(buffer + HOT_MAGIC_SIZE, &num_entries, sizeof(uint32_t));
+
+    int fd = open(pager->hot_path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        // 記録できなくても次回が遅くなるだけ
+        return;
+    }
+    write(fd, buffer, HOT_HEADER_SIZE + num_entries * HOT_ENTRY_SIZE);
+    close(fd);
+}
+
+int compare_page_nums(const void* a, const void* b) {
+    uint32_t left = *(const uint32_t*)a;
+    uint32_t right = *(const uint32_t*)b;
+    return (left > right) - (left < right);
+}
+
+// 前回閉じた時にキャッシュにあったページを，ページ番号順にまとめて読み込む
+// ファイル上で連続するページは一度のpreadvで読む
+void pager_preload_hot_pages(Pager* pager) {
+    int fd = open(pager->hot_path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    char buffer[HOT_HEADER_SIZE + TABLE_MAX_PAGES * HOT_ENTRY_SIZE];
+    ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
+    close(fd);
+
+    uint32_t num_entries = 0;
+    if (bytes_read < (ssize_t)HOT_HEADER_SIZE ||
+        memcmp(buffer, HOT_FILE_MAGIC, HOT_MAGIC_SIZE) != 0) {
+        return;
+    }
+    memcpy(&num_entries, buffer + HOT_MAGIC_SIZE, sizeof(uint32_t));
+    if (num_entries > TABLE_MAX_PAGES ||
+        bytes_read != HOT_HEADER_SIZE + num_entries * HOT_ENTRY_SIZE) {
+        return;
+    }
+
+    uint32_t page_nums[TABLE_MAX_PAGES];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        uint32_t* entry = (uint32_t*)(buffer + HOT_HEADER_SIZE + i * HOT_ENTRY_SIZE);
+        uint32_t page_num = entry[0];
+        // ファイルが記録の後に作り直されているかもしれないので，存在するページだけを読む
+        if (page_num >= pager->num_pages || pager->pages[page_num] != NULL) {
+            continue;
+        }
+        if (pager->compressed && pager->slots[page_num].length == 0) {
+            continue;
+        }
+        // 古いアクセス回数は半分にして引き継ぐ
+        pager->access_counts[page_num] = entry[1] / 2;
+        page_nums[count++] = page_num;
+    }
+    qsort(page_nums, count, sizeof(uint32_t), compare_page_nums);
+
+    uint32_t i = 0;
+    while (i < count) {
+        if (pager->compressed) {
+            // 圧縮したページは展開が必要なので1ページずつ読む
+            void* page = pager_frame(pager, page_nums[i]);
+            pager_read_page(pager, page_nums[i], page);
+            pager->pages[page_nums[i]] = page;
+            stats.preloaded_pages += 1;
+            i++;
+            continue;
+        }
+
+        // page_nums[i]から連続するページを集める
+        struct iovec iov[PRELOAD_MAX_IOV];
+        uint32_t run_length = 0;
+        while (i + run_length < count && run_length < PRELOAD_MAX_IOV &&
+               page_nums[i + run_length] == page_nums[i] + run_length) {
+            iov[run_length].iov_base = pager_frame(pager, page_nums[i + run_length]);
+            iov[run_length].iov_len = PAGE_SIZE;
+            run_length++;
+        }
+
+        ssize_t run_bytes = preadv(pager->file_descriptor, iov, run_length, pager_page_offset(pager, page_nums[i]));
+        if (run_bytes == -1) {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t j = 0; j < run_length; j++) {
+            pager->pages[page_nums[i + j]] = iov[j].iov_base;
+        }
+        stats.pages_read += run_length;
+        stats.bytes_read += run_bytes;
+        stats.preloaded_pages += run_length;
+        i += run_length;
+    }
+}
+
+/*
+ * Page Compression
+ */
+// 葉ノードの行は固定長で，usernameとemailの残りはNULで埋まっている
+// 0の連続だけをまとめる単純な符号で十分に小さくなる
+// トークンの形式:
+// 0xxxxxxx                  : 続く (x + 1) バイトをそのまま使う (1 - 128)
+// 1xxxxxxx yyyyyyyy         : 0が ((x << 8 | y) + 1) バイト続く (1 - 32768)
+uint32_t page_compress(void* page, void* destination) {
+    uint8_t* source = page;
+    uint8_t* out = destination;
+    uint32_t length = 0;
+    uint32_t i = 0;
+
+    while (i < PAGE_SIZE) {
+        uint32_t zeros = 0;
+        while (i + zeros < PAGE_SIZE && source[i + zeros] == 0) {
+            zeros++;
+        }
+        // 短い0の連続はトークンの方が大きくなるのでそのまま書く
+        if (zeros >= 3) {
+            out[length++] = 0x80 | ((zeros - 1) >> 8);
+            out[length++] = (zeros - 1) & 0xff;
+            i += zeros;
+            continue;
+        }
+
+        // 次に3バイト以上0が続くところまで(最大128バイト)をそのまま書く
+        uint32_t literal = 0;
+        while (i + literal < PAGE_SIZE && literal < 128) {
+            if (i + literal + 2 < PAGE_SIZE &&
+                source[i + literal] == 0 &&
+                source[i + literal + 1] == 0 &&
+                source[i + literal + 2] == 0) {
+                break;
+            }
+            literal++;
+        }
+        out[length++] = literal - 1;
+        memcpy(out + length, source + i, literal);
+        length += literal;
+        i += literal;
+    }
+
+    return length;
+}
+
+void page_decompress(void* source, uint32_t length, void* page) {
+    uint8_t* in = source;
+    uint8_t* out = page;
+    uint32_t position = 0;
+    uint32_t i = 0;
+
+    while (i < length) {
+        uint8_t token = in[i++];
+        uint32_t run;
+        if (token & 0x80) {
+            if (i >= length) {
+                break;
+            }
+            run = (((token & 0x7f) << 8) | in[i++]) + 1;
+            if (position + run > PAGE_SIZE) {
+                break;
+            }
+            memset(out + position, 0, run);
+        } else {
+            run = token + 1;
+            if (position + run > PAGE_SIZE || i + run > length) {
+                break;
+            }
+            memcpy(out + position, in + i, run);
+            i += run;
+        }
+        position += run;
+    }
+
+    if (i != length || position != PAGE_SIZE) {
+        printf("Compressed page is corrupt.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// format_versionに合わせて読む
+void pager_read_compressed_header(Pager* pager) {
+    bool legacy = pager->format_version == FILE_LEGACY_VERSION;
+    uint32_t header_size = legacy ? LEGACY_COMPRESSED_HEADER_SIZE : COMPRESSED_HEADER_SIZE;
+    char header[COMPRESSED_HEADER_SIZE];
+    ssize_t bytes_read = pread(pager->file_descriptor, header, header_size, 0);
+    if (bytes_read != header_size) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    pager->compressed = true;
+    pager->header_size = header_size;
+    if (legacy) {
+        memcpy(&(pager->num_pages), header + LEGACY_COMPRESSED_NUM_PAGES_OFFSET, sizeof(uint32_t));
+        for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+            uint32_t fields[3];
+            memcpy(fields, header + LEGACY_COMPRESSED_SLOTS_OFFSET + i * LEGACY_COMPRESSED_SLOT_SIZE,
+                   LEGACY_COMPRESSED_SLOT_SIZE);
+            pager->slots[i].offset = fields[0];
+            pager->slots[i].length = fields[1];
+            pager->slots[i].capacity = fields[2];
+        }
+    } else {
+        memcpy(&(pager->num_pages), header + COMPRESSED_NUM_PAGES_OFFSET, sizeof(uint32_t));
+        memcpy(pager->slots, header + COMPRESSED_SLOTS_OFFSET, sizeof(pager->slots));
+    }
+
+    // 使っている領域を位置の順に並べ，その間の隙間を空き領域にする
+    PageSlot used[TABLE_MAX_PAGES];
+    uint32_t num_used = 0;
+    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+        if (pager->slots[i].capacity > 0) {
+            used[num_used++] = pager->slots[i];
+        }
+    }
+    qsort(used, num_used, sizeof(PageSlot), compare_slot_offsets);
+
+    pager->file_end = header_size;
+    pager->num_free_regions = 0;
+    for (uint32_t i = 0; i < num_used; i++) {
+        if (used[i].offset > pager->file_end) {
+            PageSlot* region = &(pager->free_regions[pager->num_free_regions++]);
+            region->offset = pager->file_end;
+            region->length = 0;
+            region->capacity = used[i].offset - pager->file_end;
+        }
+        if (used[i].offset + used[i].capacity > pager->file_end) {
+            pager->file_end = used[i].offset + used[i].capacity;
+        }
+    }
+}
+
+// ページを全て書き出した後と，新しいファイルを作った時に呼ぶ
+void pager_write_compressed_header(Pager* pager) {
+    char header[COMPRESSED_HEADER_SIZE];
+    uint32_t header_size = pager->header_size;
+
+    if (pager->format_version == FILE_LEGACY_VERSION) {
+        // version 1のslotには32bitの位置しか書けない
+        if (pager->file_end > UINT32_MAX) {
+            printf("Db file is too large for format version %d. Run .vacuum to convert it.\n",
+                   FILE_LEGACY_VERSION);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(header, LEGACY_COMPRESSED_FILE_MAGIC, sizeof(LEGACY_COMPRESSED_FILE_MAGIC));
+        memcpy(header + LEGACY_COMPRESSED_NUM_PAGES_OFFSET, &(pager->num_pages), sizeof(uint32_t));
+        for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+            uint32_t fields[3] = {
+                (uint32_t)pager->slots[i].offset, pager->slots[i].length, pager->slots[i].capacity
+            };
+            memcpy(header + LEGACY_COMPRESSED_SLOTS_OFFSET + i * LEGACY_COMPRESSED_SLOT_SIZE,
+                   fields, LEGACY_COMPRESSED_SLOT_SIZE);
+        }
+    } else {
+        file_header_init(header, pager_file_flags(pager));
+        memcpy(header + COMPRESSED_NUM_PAGES_OFFSET, &(pager->num_pages), sizeof(uint32_t));
+        memcpy(header + COMPRESSED_SLOTS_OFFSET, pager->slots, sizeof(pager->slots));
+    }
+
+    ssize_t bytes_written = pwrite(pager->file_descriptor, header, header_size, 0);
+    if (bytes_written == -1) {
+        printf("error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// ヘッダのうちpage_numのslotとページ数だけを書く
+void pager_write_slot(Pager* pager, uint32_t page_num) {
+    PageSlot* slot = &(pager->slots[page_num]);
+    char entry[sizeof(PageSlot)];
+    uint32_t entry_size;
+    off_t slot_position;
+    off_t num_pages_position;
+
+    if (pager->format_version == FILE_LEGACY_VERSION) {
+        if (slot->offset > UINT32_MAX) {
+            printf("Db file is too large for format version %d. Run .vacuum to convert it.\n",
+                   FILE_LEGACY_VERSION);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t fields[3] = {(uint32_t)slot->offset, slot->length, slot->capacity};
+        memcpy(entry, fields, LEGACY_COMPRESSED_SLOT_SIZE);
+        entry_size = LEGACY_COMPRESSED_SLOT_SIZE;
+        slot_position = LEGACY_COMPRESSED_SLOTS_OFFSET + page_num * LEGACY_COMPRESSED_SLOT_SIZE;
+        num_pages_position = LEGACY_COMPRESSED_NUM_PAGES_OFFSET;
+    } else {
+        memcpy(entry, slot, sizeof(PageSlot));
+        entry_size = sizeof(PageSlot);
+        slot_position = COMPRESSED_SLOTS_OFFSET + page_num * sizeof(PageSlot);
+        num_pages_position = COMPRESSED_NUM_PAGES_OFFSET;
+    }
+
+    // 新しいページならページ数も増えている
+    if (pwrite(pager->file_descriptor, entry, entry_size, slot_position) == -1 ||
+        pwrite(pager->file_descriptor, &(pager->num_pages), sizeof(uint32_t), num_pages_position) == -1) {
+        printf("error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// capacityの領域を空き領域から探し，なければファイルの末尾に追加する
+// 空き領域は最も小さく収まるものを使い，余りは空き領域に残す
+uint64_t pager_allocate_region(Pager* pager, uint32_t capacity) {
+    uint32_t best = pager->num_free_regions;
+    for (uint32_t i = 0; i < pager->num_free_regions; i++) {
+        PageSlot* region = &(pager->free_regions[i]);
+        if (region->capacity >= capacity &&
+            (best == pager->num_free_regions || region->capacity < pager->free_regions[best].capacity)) {
+            best = i;
+        }
+    }
+
+    if (best == pager->num_free_regions) {
+        uint64_t offset = pager->file_end;
+        pager->file_end += capacity;
+        return offset;
+    }
+
+    PageSlot* region = &(pager->free_regions[best]);
+    uint64_t offset = region->offset;
+    region->offset += capacity;
+    region->capacity -= capacity;
+    if (region->capacity == 0) {
+        pager->num_free_regions -= 1;
+        *region = pager->free_regions[pager->num_free_regions];
+    }
+    return offset;
+}
+
+// 隣り合う空き領域とはつなげておく (空き領域の数は使っている領域の数を超えない)
+// ファイルの末尾の領域なら，末尾を縮めて次の追加で使う
+void pager_free_region(Pager* pager, uint64_t offset, uint32_t capacity) {
+    uint32_t i = 0;
+    while (i < pager->num_free_regions) {
+        PageSlot* region = &(pager->free_regions[i]);
+        if (region->offset + region->capacity == offset || offset + capacity == region->offset) {
+            if (region->offset < offset) {
+                offset = region->offset;
+            }
+            capacity += region->capacity;
+            pager->num_free_regions -= 1;
+            *region = pager->free_regions[pager->num_free_regions];
+            i = 0;
+            continue;
+        }
+        i++;
+    }
+
+    if (offset + capacity == pager->file_end) {
+        pager->file_end = offset;
+        return;
+    }
+    if (pager->num_free_regions == TABLE_MAX_PAGES) {
+        // つなげていれば起きないが，溢れたら使わずに捨てる
+        return;
+    }
+    PageSlot* region = &(pager->free_regions[pager->num_free_regions++]);
+    region->offset = offset;
+    region->length = 0;
+    region->capacity = capacity;
+}
+
+int compare_slot_offsets(const void* a, const void* b) {
+    uint64_t x = ((const PageSlot*)a)->offset;
+    uint64_t y = ((const PageSlot*)b)->offset;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Hash Index
+ */
+// idを散らす (murmur3の最後の混ぜ合わせ)
+// extendible hashingは下位bitから使うので，連続したidも別のバケットに分かれるようにする
+uint32_t hash_key(uint32_t key) {
+    key ^= key >> 16;
+    key *= 0x85ebca6b;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35;
+    key ^= key >> 16;
+    return key;
+}
+
+uint32_t* hash_directory_global_depth(void* node) {
+    return node + HASH_DIRECTORY_GLOBAL_DEPTH_OFFSET;
+}
+
+uint32_t* hash_directory_bucket(void* node, uint32_t index) {
+    return node + HASH_DIRECTORY_BUCKETS_OFFSET + index * sizeof(uint32_t);
+}
+
+uint32_t* hash_bucket_local_depth(void* node) {
+    return node + HASH_BUCKET_LOCAL_DEPTH_OFFSET;
+}
+
+uint32_t* hash_bucket_num_entries(void* node) {
+    return node + HASH_BUCKET_NUM_ENTRIES_OFFSET;
+}
+
+uint32_t* hash_bucket_key(void* node, uint32_t entry_num) {
+    return node + HASH_BUCKET_HEADER_SIZE + entry_num * HASH_ENTRY_SIZE + HASH_ENTRY_KEY_OFFSET;
+}
+
+uint32_t* hash_bucket_page_num(void* node, uint32_t entry_num) {
+    return node + HASH_BUCKET_HEADER_SIZE + entry_num * HASH_ENTRY_SIZE + HASH_ENTRY_PAGE_NUM_OFFSET;
+}
+
+uint32_t* hash_bucket_cell_num(void* node, uint32_t entry_num) {
+    return node + HASH_BUCKET_HEADER_SIZE + entry_num * HASH_ENTRY_SIZE + HASH_ENTRY_CELL_NUM_OFFSET;
+}
+
+void initialize_hash_bucket(void* node, uint32_t local_depth) {
+    *((uint8_t*)(node + NODE_TYPE_OFFSET)) = NODE_TYPE_HASH_BUCKET;
+    set_node_root(node, false);
+    *hash_bucket_local_depth(node) = local_depth;
+    *hash_bucket_num_entries(node) = 0;
+}
+
+// 空のバケット一つを全てのidが指す索引を作る
+// ディレクトリはHASH_DIRECTORY_PAGE_NUMに置くので，呼ぶ前にそのページを木に使ってはいけない
+void hash_index_create(Pager* pager) {
+    void* directory = get_page(pager, HASH_DIRECTORY_PAGE_NUM);
+    pager_mark_dirty(pager, HASH_DIRECTORY_PAGE_NUM);
+    *((uint8_t*)(directory + NODE_TYPE_OFFSET)) = NODE_TYPE_HASH_DIRECTORY;
+    set_node_root(directory, false);
+    *hash_directory_global_depth(directory) = 0;
+
+    uint32_t bucket_page_num = get_unused_page_num(pager);
+    void* bucket = get_page(pager, bucket_page_num);
+    pager_mark_dirty(pager, bucket_page_num);
+    initialize_hash_bucket(bucket, 0);
+    *hash_directory_bucket(directory, 0) = bucket_page_num;
+}
+
+// keyが入るバケットのページ番号
+uint32_t hash_index_bucket(Pager* pager, uint32_t key) {
+    void* directory = get_page(pager, HASH_DIRECTORY_PAGE_NUM);
+    uint32_t mask = (1u << *hash_directory_global_depth(directory)) - 1;
+    return *hash_directory_bucket(directory, hash_key(key) & mask);
+}
+
+// バケットの中のkeyの位置を返す．なければnum_entriesを返す
+uint32_t hash_bucket_find(void* bucket, uint32_t key) {
+    uint32_t num_entries = *hash_bucket_num_entries(bucket);
+    for (uint32_t i = 0; i < num_entries; i++) {
+        if (*hash_bucket_key(bucket, i) == key) {
+            return i;
+        }
+    }
+    return num_entries;
+}
+
+bool hash_index_find(Pager* pager, uint32_t key, uint32_t* page_num, uint32_t* cell_num) {
+    stats.hash_index_probes += 1;
+    void* bucket = get_page(pager, hash_index_bucket(pager, key));
+    uint32_t entry_num = hash_bucket_find(bucket, key);
+    if (entry_num == *hash_bucket_num_entries(bucket)) {
+        return false;
+    }
+
+    *page_num = *hash_bucket_page_num(bucket, entry_num);
+    *cell_num = *hash_bucket_cell_num(bucket, entry_num);
+    return true;
+}
+
+// keyの位置を記録する．バケットが満杯なら分割してからやり直す
+void hash_index_put(Pager* pager, uint32_t key, uint32_t page_num, uint32_t cell_num) {
+    while (true) {
+        uint32_t bucket_page_num = hash_index_bucket(pager, key);
+        void* bucket = get_page(pager, bucket_page_num);
+        uint32_t num_entries = *hash_bucket_num_entries(bucket);
+        uint32_t entry_num = hash_bucket_find(bucket, key);
+
+        if (entry_num < num_entries &&
+            *hash_bucket_page_num(bucket, entry_num) == page_num &&
+            *hash_bucket_cell_num(bucket, entry_num) == cell_num) {
+            // 位置が変わっていなければページを汚さない
+            return;
+        }
+        if (entry_num < num_entries || num_entries < HASH_BUCKET_MAX_ENTRIES) {
+            pager_mark_dirty(pager, bucket_page_num);
+            *hash_bucket_key(bucket, entry_num) = key;
+            *hash_bucket_page_num(bucket, entry_num) = page_num;
+            *hash_bucket_cell_num(bucket, entry_num) = cell_num;
+            if (entry_num == num_entries) {
+                *hash_bucket_num_entries(bucket) = num_entries + 1;
+            }
+            return;
+        }
+
+        hash_bucket_split(pager, bucket_page_num);
+    }
+}
+
+// バケットは空になっても併合しない (ディレクトリは縮めない)
+void hash_index_remove(Pager* pager, uint32_t key) {
+    if (!pager->hash_index) {
+        return;
+    }
+
+    uint32_t bucket_page_num = hash_index_bucket(pager, key);
+    void* bucket = get_page(pager, bucket_page_num);
+    uint32_t num_entries = *hash_bucket_num_entries(bucket);
+    uint32_t entry_num = hash_bucket_find(bucket, key);
+    if (entry_num == num_entries) {
+        return;
+    }
+
+    // 最後の要素で埋める (バケットの中の順序は問わない)
+    pager_mark_dirty(pager, bucket_page_num);
+    memcpy(hash_bucket_key(bucket, entry_num), hash_bucket_key(bucket, num_entries - 1), HASH_ENTRY_SIZE);
+    memset(hash_bucket_key(bucket, num_entries - 1), 0, HASH_ENTRY_SIZE);
+    *hash_bucket_num_entries(bucket) = num_entries - 1;
+}
+
+// バケットを二つに分け，hashのlocal_depth番目のbitが1のidを新しいバケットへ移す
+// バケットのlocal_depthがglobal_depthに達していれば，先にディレクトリを倍にする
+void hash_bucket_split(Pager* pager, uint32_t bucket_page_num) {
+    void* directory = get_page(pager, HASH_DIRECTORY_PAGE_NUM);
+    void* bucket = get_page(pager, bucket_page_num);
+    uint32_t global_depth = *hash_directory_global_depth(directory);
+    uint32_t local_depth = *hash_bucket_local_depth(bucket);
+    pager_mark_dirty(pager, HASH_DIRECTORY_PAGE_NUM);
+
+    if (local_depth == global_depth) {
+        if (global_depth == HASH_DIRECTORY_MAX_DEPTH) {
+            printf("Error: Hash index full.\n");
+            exit(EXIT_FAILURE);
+        }
+        // 後半は前半と同じバケットを指す
+        uint32_t size = 1u << global_depth;
+        memcpy(hash_directory_bucket(directory, size), hash_directory_bucket(directory, 0),
+               size * sizeof(uint32_t));
+        global_depth += 1;
+        *hash_directory_global_depth(directory) = global_depth;
+    }
+
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void* new_bucket = get_page(pager, new_page_num);
+    pager_mark_dirty(pager, bucket_page_num);
+    pager_mark_dirty(pager, new_page_num);
+    initialize_hash_bucket(new_bucket, local_depth + 1);
+    *hash_bucket_local_depth(bucket) = local_depth + 1;
+    stats.hash_bucket_splits += 1;
+
+    uint32_t bit = 1u << local_depth;
+    uint32_t num_entries = *hash_bucket_num_entries(bucket);
+    uint32_t num_kept = 0;
+    uint32_t num_moved = 0;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        if (hash_key(*hash_bucket_key(bucket, i)) & bit) {
+            memcpy(hash_bucket_key(new_bucket, num_moved), hash_bucket_key(bucket, i), HASH_ENTRY_SIZE);
+            num_moved++;
+        } else {
+            memmove(hash_bucket_key(bucket, num_kept), hash_bucket_key(bucket, i), HASH_ENTRY_SIZE);
+            num_kept++;
+        }
+    }
+    // 空いた要素は0にしておく(圧縮しやすくなる)
+    memset(hash_bucket_key(bucket, num_kept), 0, (num_entries - num_kept) * HASH_ENTRY_SIZE);
+    *hash_bucket_num_entries(bucket) = num_kept;
+    *hash_bucket_num_entries(new_bucket) = num_moved;
+
+    for (uint32_t i = 0; i < (1u << global_depth); i++) {
+        if (*hash_directory_bucket(directory, i) == bucket_page_num && (i & bit)) {
+            *hash_directory_bucket(directory, i) = new_page_num;
+        }
+    }
+}
+
+// 葉のfrom_cell以降のセルの位置を記録し直す
+// 葉のセルを挿入，削除，移動した後に，位置が変わったかもしれない範囲について呼ぶ
+void hash_index_update_leaf(Pager* pager, uint32_t page_num, uint32_t from_cell) {
+    if (!pager->hash_index) {
+        return;
+    }
+
+    void* node = get_page(pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    for (uint32_t i = from_cell; i < num_cells; i++) {
+        hash_index_put(pager, *leaf_node_key(node, i), page_num, i);
+    }
+}
+
+// keyのセルを指すカーソルを返す．索引にkeyがなければNULL
+// 索引は今の木を指しているので，スナップショットから読む時は使わない
+Cursor* hash_index_seek(Table* table, uint32_t key) {
+    uint32_t page_num;
+    uint32_t cell_num;
+    if (!table->pager->hash_index || table->view != NULL ||
+        !hash_index_find(table->pager, key, &page_num, &cell_num)) {
+        return NULL;
+    }
+
+    Cursor* cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->cell_num = cell_num;
+    cursor->end_of_table = false;
+    cursor->leaf_hops = 0;
+    cursor->readahead_window = READAHEAD_MIN_PAGES;
+    cursor->readahead_remaining = 0;
+    return cursor;
+}
+
+/*
+ * Backup
+ */
+// 前回のバックアップの後に書き出したページの記録を読み込む
+// 記録が壊れていれば記録なしとして扱い，次のバックアップで全体を写す
+void pager_open_changed(Pager* pager) {
+    pager->changed_path = malloc(strlen(pager->filename) + sizeof("-changed"));
+    sprintf(pager->changed_path, "%s-changed", pager->filename);
+    pager->last_backup_path = NULL;
+    memset(pager->changed, 0, sizeof(pager->changed));
+    memset(pager->changed_saved, 0, sizeof(pager->changed_saved));
+
+    pager->changed_fd = open(pager->changed_path, O_RDWR);
+    if (pager->changed_fd == -1) {
+        return;
+    }
+
+    char buffer[CHANGED_PATH_OFFSET + CHANGED_MAX_PATH];
+    ssize_t bytes_read = pread(pager->changed_fd, buffer, sizeof(buffer), 0);
+    uint32_t path_length = 0;
+    if (bytes_read >= (ssize_t)CHANGED_PATH_OFFSET) {
+        memcpy(&path_length, buffer + CHANGED_PATH_LENGTH_OFFSET, sizeof(uint32_t));
+    }
+    if (bytes_read < (ssize_t)CHANGED_PATH_OFFSET ||
+        memcmp(buffer, CHANGED_FILE_MAGIC, CHANGED_MAGIC_SIZE) != 0 ||
+        path_length == 0 || path_length >= CHANGED_MAX_PATH ||
+        bytes_read != CHANGED_PATH_OFFSET + path_length) {
+        close(pager->changed_fd);
+        pager->changed_fd = -1;
+        return;
+    }
+
+    memcpy(pager->changed, buffer + CHANGED_BITMAP_OFFSET, CHANGED_BITMAP_SIZE);
+    memcpy(pager->changed_saved, pager->changed, CHANGED_BITMAP_SIZE);
+    pager->last_backup_path = strndup(buffer + CHANGED_PATH_OFFSET, path_length);
+}
+
+bool pager_page_changed(Pager* pager, uint32_t page_num) {
+    return pager->changed[page_num / 8] & (1 << (page_num % 8));
+}
+
+// pager_flushから呼ぶ
+// 変更したページを最後のバックアップの後で初めて書き出した時だけファイルに書く
+// 書き出していない変更は，閉じずに終わればファイルにも残らないので記録しなくてよい
+void pager_save_changed(Pager* pager, uint32_t page_num) {
+    uint8_t bit = 1 << (page_num % 8);
+    if (pager->changed_fd == -1 || !(pager->changed[page_num / 8] & bit) ||
+        (pager->changed_saved[page_num / 8] & bit)) {
+        return;
+    }
+
+    pager->changed_saved[page_num / 8] |= bit;
+    ssize_t bytes_written = pwrite(pager->changed_fd, &(pager->changed_saved[page_num / 8]), 1,
+                                   CHANGED_BITMAP_OFFSET + page_num / 8);
+    if (bytes_written == -1) {
+        printf("error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// バックアップが終わった後に，今のビットマップとバックアップのファイルを記録する
+void pager_write_changed(Pager* pager, const char* backup_path) {
+    uint32_t path_length = strlen(backup_path);
+    if (path_length >= CHANGED_MAX_PATH) {
+        return;
+    }
+
+    char buffer[CHANGED_PATH_OFFSET + CHANGED_MAX_PATH];
+    memcpy(buffer, CHANGED_FILE_MAGIC, CHANGED_MAGIC_SIZE);
+    memcpy(buffer + CHANGED_BITMAP_OFFSET, pager->changed_saved, CHANGED_BITMAP_SIZE);
+    memcpy(buffer + CHANGED_PATH_LENGTH_OFFSET, &path_length, sizeof(uint32_t));
+    memcpy(buffer + CHANGED_PATH_OFFSET, backup_path, path_length);
+
+    if (pager->changed_fd == -1) {
+        pager->changed_fd = open(pager->changed_path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+        if (pager->changed_fd == -1) {
+            printf("Error writing changed page file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (pwrite(pager->changed_fd, buffer, CHANGED_PATH_OFFSET + path_length, 0) == -1 ||
+        ftruncate(pager->changed_fd, CHANGED_PATH_OFFSET + path_length) == -1 ||
+        fsync(pager->changed_fd) == -1) {
+        printf("Error writing changed page file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    free(pager->last_backup_path);
+    pager->last_backup_path = strdup(backup_path);
+}
+
+// 開いたままのデータベースをpathに写す
+// 写している間は文の実行と書き込みスレッドを止めるので，ある時点の一貫した内容になる
+// incrementalなら，前回のバックアップの後に変更したページだけを前回のファイルに上書きする
+// (前回と違うファイルや記録がない場合は全体を写す)
+void backup_table(Table* table, const char* path, bool incremental) {
+    Pager* pager = table->pager;
+    pthread_mutex_lock(&(pager->lock));
+    if (table->write_buffer != NULL) {
+        write_buffer_flush(table);
+    }
+
+    incremental = incremental && pager->changed_fd != -1 &&
+        pager->last_backup_path != NULL && strcmp(pager->last_backup_path, path) == 0 &&
+        access(path, F_OK) == 0;
+
+    // 全体を写す時は別のファイルに書いてから置き換え，途中で失敗しても前回のバックアップを残す
+    char* target = malloc(strlen(path) + sizeof("-partial-changed"));
+    sprintf(target, incremental ? "%s" : "%s-partial", path);
+    if (!incremental) {
+        unlink(target);
+    }
+    char* sidecar = malloc(strlen(path) + sizeof("-partial-changed"));
+    const char* suffixes[] = {"-hot", "-changed", "-partial-hot", "-partial-changed"};
+    for (uint32_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        sprintf(sidecar, "%s%s", path, suffixes[i]);
+        unlink(sidecar);
+    }
+
+    Pager* backup = pager_open(target, pager_format_open_flags(pager));
+    uint32_t num_copied = 0;
+    for (uint32_t i = 0; i < pager->num_pages; i++) {
+        if (incremental && !pager_page_changed(pager, i)) {
+            continue;
+        }
+        void* source = get_page(pager, i);
+        void* destination = get_page(backup, i);
+        pager_mark_dirty(backup, i);
+        memcpy(destination, source, PAGE_SIZE);
+        num_copied++;
+    }
+    // ここから後に変更したページは次のバックアップで写す
+    memset(pager->changed, 0, sizeof(pager->changed));
+    memset(pager->changed_saved, 0, sizeof(pager->changed_saved));
+    uint32_t num_pages = pager->num_pages;
+    pthread_mutex_unlock(&(pager->lock));
+
+    pager_close(backup);
+    int fd = open(target, O_RDONLY);
+    if (fd == -1 || fsync(fd) == -1) {
+        printf("Error syncing backup file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    if (!incremental && rename(target, path) == -1) {
+        printf("Error replacing backup file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        sprintf(sidecar, "%s%s", path, suffixes[i]);
+        unlink(sidecar);
+    }
+
+    pthread_mutex_lock(&(pager->lock));
+    pager_write_changed(pager, path);
+    pthread_mutex_unlock(&(pager->lock));
+
+    printf("Backed up %d of %d pages to %s (%s).\n", num_copied, num_pages, path,
+           incremental ? "incremental" : "full");
+    free(sidecar);
+    free(target);
+}
+
+/*
+ * Page Frames
+ */
+// 全ページ分の枠をmmapでまとめて確保する
+// 枠はページ境界に揃い(O_DIRECTの条件)，触るまで物理メモリを使わず，最初は0で埋まっている
+void pager_allocate_frames(Pager* pager) {
+    size_t size = (size_t)TABLE_MAX_PAGES * PAGE_SIZE;
+    size_t alignment = (pager->flags & DB_OPEN_HUGE_PAGES) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+    // mmapはページ境界にしか揃わないので，大きく確保して中の揃った位置を使う
+    size_t mapping_size = size + alignment - PAGE_SIZE;
+    void* mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        printf("Unable to allocate page frames: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    uintptr_t start = ((uintptr_t)mapping + alignment - 1) / alignment * alignment;
+    pager->frames = (void*)start;
+    pager->frames_mapping = mapping;
+    pager->frames_mapping_size = mapping_size;
+
+    if (pager->flags & DB_OPEN_HUGE_PAGES) {
+        // ただのヒントなので，使えないカーネルでも失敗にはしない
+        madvise(pager->frames, size, MADV_HUGEPAGE);
+    }
+}
+
+void* pager_frame(Pager* pager, uint32_t page_num) {
+    return (char*)pager->frames + (size_t)page_num * PAGE_SIZE;
+}
+
+// 以降の読み書きはOSのページキャッシュを通さず，pagerのキャッシュだけがキャッシュになる
+// 枠，ファイル上の位置(ヘッダもPAGE_SIZE)，長さが全てページ境界に揃っている必要がある
+void pager_enable_direct_io(Pager* pager) {
+    int flags = fcntl(pager->file_descriptor, F_GETFL);
+    if (flags == -1 || fcntl(pager->file_descriptor, F_SETFL, flags | O_DIRECT) == -1) {
+        printf("Direct I/O is not supported for this file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager->direct_io = true;
+}
+
+/*
+ * File Header
+ */
+// 通常のファイルでのページの位置
+// page_num * PAGE_SIZEを32bitで計算すると4GiBを超える位置で溢れるので，64bitで計算する
+off_t pager_page_offset(Pager* pager, uint32_t page_num) {
+    return (off_t)pager->header_size + (off_t)page_num * PAGE_SIZE;
+}
+
+// 最新の形式の共通部分を書き込む
+void file_header_init(void* header, uint32_t flags) {
+    memset(header, 0, FILE_COMMON_HEADER_SIZE);
+    memcpy(header, FILE_MAGIC, FILE_MAGIC_SIZE);
+    memcpy((char*)header + FILE_VERSION_OFFSET, &FILE_FORMAT_VERSION, sizeof(uint32_t));
+    memcpy((char*)header + FILE_PAGE_NUM_SIZE_OFFSET, &PAGE_NUM_SIZE, sizeof(uint32_t));
+    memcpy((char*)header + FILE_FLAGS_OFFSET, &flags, sizeof(uint32_t));
+}
+
+void pager_read_file_header(Pager* pager) {
+    char header[FILE_COMMON_HEADER_SIZE];
+    ssize_t bytes_read = pread(pager->file_descriptor, header, FILE_COMMON_HEADER_SIZE, 0);
+    if (bytes_read != FILE_COMMON_HEADER_SIZE) {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t page_num_size;
+    uint32_t flags;
+    memcpy(&(pager->format_version), header + FILE_VERSION_OFFSET, sizeof(uint32_t));
+    memcpy(&page_num_size, header + FILE_PAGE_NUM_SIZE_OFFSET, sizeof(uint32_t));
+    memcpy(&flags, header + FILE_FLAGS_OFFSET, sizeof(uint32_t));
+
+    // 新しい版で作られたファイルは読めない
+    if (pager->format_version > FILE_FORMAT_VERSION) {
+        printf("Unsupported file format version %d.\n", pager->format_version);
+        exit(EXIT_FAILURE);
+    }
+    if (page_num_size != PAGE_NUM_SIZE) {
+        printf("Unsupported page number size %d.\n", page_num_size);
+        exit(EXIT_FAILURE);
+    }
+
+    if (flags & FILE_FLAG_COMPRESSED) {
+        pager_read_compressed_header(pager);
+    } else {
+        pager->header_size = FILE_HEADER_SIZE;
+    }
+    if (flags & FILE_FLAG_PAX_LEAVES) {
+        pager->leaf_layout = LEAF_LAYOUT_PAX;
+    }
+    if (flags & FILE_FLAG_HASH_INDEX) {
+        pager->hash_index = true;
+    }
+}
+
+// 通常のファイルのヘッダはファイルを作る時に一度だけ書く
+void pager_write_file_header(Pager* pager) {
+    char header[FILE_HEADER_SIZE];
+    memset(header, 0, FILE_HEADER_SIZE);
+    file_header_init(header, pager_file_flags(pager));
+
+    ssize_t bytes_written = pwrite(pager->file_descriptor, header, FILE_HEADER_SIZE, 0);
+    if (bytes_written == -1) {
+        printf("error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// ヘッダに記録するファイルの形式
+uint32_t pager_file_flags(Pager* pager) {
+    uint32_t flags = 0;
+    if (pager->compressed) {
+        flags |= FILE_FLAG_COMPRESSED;
+    }
+    if (pager->leaf_layout == LEAF_LAYOUT_PAX) {
+        flags |= FILE_FLAG_PAX_LEAVES;
+    }
+    if (pager->hash_index) {
+        flags |= FILE_FLAG_HASH_INDEX;
+    }
+    return flags;
+}
+
+// 同じ形式のファイルを新しく作る時にpager_openへ渡すフラグ (.vacuumと.backupで使う)
+uint32_t pager_format_open_flags(Pager* pager) {
+    uint32_t flags = pager->flags & ~(DB_OPEN_COMPRESSED | DB_OPEN_PAX_LEAVES | DB_OPEN_HASH_INDEX);
+    if (pager->compressed) {
+        flags |= DB_OPEN_COMPRESSED;
+    }
+    if (pager->leaf_layout == LEAF_LAYOUT_PAX) {
+        flags |= DB_OPEN_PAX_LEAVES;
+    }
+    if (pager->hash_index) {
+        flags |= DB_OPEN_HASH_INDEX;
+    }
+    return flags;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_reset() {
+    memset(&stats, 0, sizeof(Stats));
+}
+
+void record_latency(StatementType type, uint64_t ns) {
+    LatencyHistogram* histogram = &(stats.latency[type]);
+
+    // 0ナノ秒はバケット0，それ以外はビット長のバケットに入れる
+    uint32_t bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= LATENCY_BUCKETS) {
+        bucket = LATENCY_BUCKETS - 1;
+    }
+
+    histogram->buckets[bucket] += 1;
+    histogram->count += 1;
+    histogram->total_ns += ns;
+}
+
+// q (0 - 1) 分位点が入っているバケットの上限を返す
+uint64_t latency_percentile(LatencyHistogram* histogram, double q) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(q * histogram->count);
+    if (rank >= histogram->count) {
+        rank = histogram->count - 1;
+    }
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > rank) {
+            return i == 0 ? 0 : (i >= 63 ? UINT64_MAX : (1ULL << i));
+        }
+    }
+    return UINT64_MAX;
+}
+
+const char* statement_type_name(StatementType type) {
+    switch (type) {
+        case (STATEMENT_INSERT):
+            return "insert";
+        case (STATEMENT_SELECT):
+            return "select";
+        case (STATEMENT_DELETE):
+            return "delete";
+        case (STATEMENT_UPDATE):
+            return "update";
+    }
+    return "unknown";
+}
+
+void print_stats() {
+    double hit_ratio = stats.page_requests == 0 ? 0 :
+        (double)stats.page_hits / stats.page_requests;
+
+    printf("page_requests: %llu\n", (unsigned long long)stats.page_requests);
+    printf("page_hits: %llu\n", (unsigned long long)stats.page_hits);
+    printf("page_misses: %llu\n", (unsigned long long)stats.page_misses);
+    printf("cache_hit_ratio: %.3f\n", hit_ratio);
+    printf("pages_read: %llu\n", (unsigned long long)stats.pages_read);
+    printf("bytes_read: %llu\n", (unsigned long long)stats.bytes_read);
+    printf("pages_written: %llu\n", (unsigned long long)stats.pages_written);
+    printf("bytes_written: %llu\n", (unsigned long long)stats.bytes_written);
+    printf("flush_ns: %llu\n", (unsigned long long)stats.flush_ns);
+    printf("background_pages_written: %llu\n", (unsigned long long)stats.background_pages_written);
+    printf("readahead_pages: %llu\n", (unsigned long long)stats.readahead_pages);
+    printf("preloaded_pages: %llu\n", (unsigned long long)stats.preloaded_pages);
+    printf("snapshot_pages_copied: %llu\n", (unsigned long long)stats.snapshot_pages_copied);
+    printf("leaf_splits: %llu\n", (unsigned long long)stats.leaf_splits);
+    printf("root_splits: %llu\n", (unsigned long long)stats.root_splits);
+    printf("internal_node_inserts: %llu\n", (unsigned long long)stats.internal_node_inserts);
+    printf("node_borrows: %llu\n", (unsigned long long)stats.node_borrows);
+    printf("node_merges: %llu\n", (unsigned long long)stats.node_merges);
+    printf("root_collapses: %llu\n", (unsigned long long)stats.root_collapses);
+    printf("binary_search_probes: %llu\n", (unsigned long long)stats.binary_search_probes);
+    printf("hash_index_probes: %llu\n", (unsigned long long)stats.hash_index_probes);
+    printf("hash_bucket_splits: %llu\n", (unsigned long long)stats.hash_bucket_splits);
+    printf("write_buffer_tree_skips: %llu\n", (unsigned long long)stats.write_buffer_tree_skips);
+
+    for (uint32_t i = 0; i < NUM_STATEMENT_TYPES; i++) {
+        LatencyHistogram* histogram = &(stats.latency[i]);
+        printf("%s: count %llu, mean_ns %llu, p50_ns < %llu, p99_ns < %llu\n",
+            statement_type_name(i),
+            (unsigned long long)histogram->count,
+            (unsigned long long)(histogram->count == 0 ? 0 : histogram->total_ns / histogram->count),
+            (unsigned long long)latency_percentile(histogram, 0.5),
+            (unsigned long long)latency_percentile(histogram, 0.99));
+    }
+}
+
+void write_stats_json(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        printf("Unable to open stats file\n");
+        return;
+    }
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"page_requests\": %llu,\n", (unsigned long long)stats.page_requests);
+    fprintf(file, "  \"page_hits\": %llu,\n", (unsigned long long)stats.page_hits);
+    fprintf(file, "  \"page_misses\": %llu,\n", (unsigned long long)stats.page_misses);
+    fprintf(file, "  \"pages_read\": %llu,\n", (unsigned long long)stats.pages_read);
+    fprintf(file, "  \"bytes_read\": %llu,\n", (unsigned long long)stats.bytes_read);
+    fprintf(file, "  \"pages_written\": %llu,\n", (unsigned long long)stats.pages_written);
+    fprintf(file, "  \"bytes_written\": %llu,\n", (unsigned long long)stats.bytes_written);
+    fprintf(file, "  \"flush_ns\": %llu,\n", (unsigned long long)stats.flush_ns);
+    fprintf(file, "  \"background_pages_written\": %llu,\n", (unsigned long long)stats.background_pages_written);
+    fprintf(file, "  \"readahead_pages\": %llu,\n", (unsigned long long)stats.readahead_pages);
+    fprintf(file, "  \"preloaded_pages\": %llu,\n", (unsigned long long)stats.preloaded_pages);
+    fprintf(file, "  \"snapshot_pages_copied\": %llu,\n", (unsigned long long)stats.snapshot_pages_copied);
+    fprintf(file, "  \"leaf_splits\": %llu,\n", (unsigned long long)stats.leaf_splits);
+    fprintf(file, "  \"root_splits\": %llu,\n", (unsigned long long)stats.root_splits);
+    fprintf(file, "  \"internal_node_inserts\": %llu,\n", (unsigned long long)stats.internal_node_inserts);
+    fprintf(file, "  \"node_borrows\": %llu,\n", (unsigned long long)stats.node_borrows);
+    fprintf(file, "  \"node_merges\": %llu,\n", (unsigned long long)stats.node_merges);
+    fprintf(file, "  \"root_collapses\": %llu,\n", (unsigned long long)stats.root_collapses);
+    fprintf(file, "  \"binary_search_probes\": %llu,\n", (unsigned long long)stats.binary_search_probes);
+    fprintf(file, "  \"hash_index_probes\": %llu,\n", (unsigned long long)stats.hash_index_probes);
+    fprintf(file, "  \"hash_bucket_splits\": %llu,\n", (unsigned long long)stats.hash_bucket_splits);
+    fprintf(file, "  \"write_buffer_tree_skips\": %llu,\n", (unsigned long long)stats.write_buffer_tree_skips);
+    fprintf(file, "  \"latency\": {\n");
+    for (uint32_t i = 0; i < NUM_STATEMENT_TYPES; i++) {
+        LatencyHistogram* histogram = &(stats.latency[i]);
+        fprintf(file, "    \"%s\": {\"count\": %llu, \"total_ns\": %llu, \"buckets\": [",
+            statement_type_name(i),
+            (unsigned long long)histogram->count,
+            (unsigned long long)histogram->total_ns);
+        for (uint32_t j = 0; j < LATENCY_BUCKETS; j++) {
+            fprintf(file, j == 0 ? "%llu" : ", %llu", (unsigned long long)histogram->buckets[j]);
+        }
+        fprintf(file, "]}%s\n", i + 1 < NUM_STATEMENT_TYPES ? "," : "");
+    }
+    fprintf(file, "  }\n");
+    fprintf(file, "}\n");
+
+    fclose(file);
+}
+
+void trace_page(Pager* pager, uint32_t page_num, uint8_t flags) {
+    TraceRecord record;
+    record.page_num = page_num;
+    record.flags = flags;
+    record.node_type = get_node_type(pager->pages[page_num]);
+    record.statement_type = trace.statement_type;
+
+    if (trace.file != NULL && fwrite(&record, sizeof(TraceRecord), 1, trace.file) != 1) {
+        printf("Error writing trace file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    // 数えるのは.explainの間だけ (--traceだけでは数え続けない)
+    if (trace.explaining) {
+        if (trace.num_records < TRACE_MAX_RECORDS) {
+            trace.records[trace.num_records] = record;
+        }
+        trace.num_records += 1;
+    }
+}
+
+// 書き出しきれなかった記録はfcloseで失敗する
+void trace_close() {
+    if (trace.file != NULL && fclose(trace.file) != 0) {
+        printf("Error writing trace file: %d\n", errno);
         exit(EXIT_FAILURE);
     }
+    trace.file = NULL;
+}
 
-    if (pager->pages[page_num] == NULL) {
-        // キャッシュヒットしない場合, ファイルからロードしてpageをメモリ確保する
-        void* page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
-
-        // ファイルの最後にページの一部を保存する可能性あり
-        if (pager->file_length % PAGE_SIZE) {
-            num_pages += 1;
-        }
-
-        if (page_num <= num_pages) {
-            // SEEK_SET オフセットはファイルの先頭から
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            // read(int fd, void* buf, size_t count): ファイルディスクリプタから読み込む
-            // fd: ファイルディスクリプタ, buf: 読み込み先バッファ, count: 読み込むバイト数
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1) {
-                printf("Error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
+// 文を実行し，辿ったページとカウンタの差分を表示する
+// .explain select id where username = foo
+void explain_statement(InputBuffer* input_buffer, Table* table) {
+    // ".explain " を取り除いて通常の文として扱う
+    uint32_t prefix_length = strlen(".explain ");
+    memmove(input_buffer->buffer, input_buffer->buffer + prefix_length,
+        strlen(input_buffer->buffer) - prefix_length + 1);
+
+    Stats before = stats;
+    trace.explaining = true;
+    trace.num_records = 0;
+
+    run_statement(input_buffer, table);
+
+    trace.explaining = false;
+
+    printf("Explain:\n");
+    uint32_t num_records = trace.num_records < TRACE_MAX_RECORDS ? trace.num_records : TRACE_MAX_RECORDS;
+    for (uint32_t i = 0; i < num_records; i++) {
+        TraceRecord* record = &(trace.records[i]);
+
+        // 走査では同じページを続けて何度も取得するので，まとめて表示する
+        uint32_t repeat = 1;
+        while (i + 1 < num_records &&
+               trace.records[i + 1].page_num == record->page_num &&
+               trace.records[i + 1].flags == TRACE_PAGE_HIT &&
+               (record->flags & TRACE_PAGE_HIT)) {
+            repeat++;
+            i++;
+        }
+
+        const char* type;
+        if (record->flags & TRACE_PAGE_NEW) {
+            type = "new";
+        } else if (record->node_type == NODE_LEAF) {
+            type = "leaf";
+        } else if (record->node_type == NODE_TYPE_HASH_DIRECTORY || record->node_type == NODE_TYPE_HASH_BUCKET) {
+            type = "hash";
+        } else {
+            type = "internal";
+        }
+        printf("- page %d %s %s", record->page_num, type, (record->flags & TRACE_PAGE_HIT) ? "hit" : "miss");
+        if (repeat > 1) {
+            printf(" x%d", repeat);
+        }
+        printf("\n");
+    }
+    if (trace.num_records > TRACE_MAX_RECORDS) {
+        printf("- ... %d more\n", trace.num_records - TRACE_MAX_RECORDS);
+    }
+
+    printf("page_requests: %llu\n", (unsigned long long)(stats.page_requests - before.page_requests));
+    printf("page_hits: %llu\n", (unsigned long long)(stats.page_hits - before.page_hits));
+    printf("page_misses: %llu\n", (unsigned long long)(stats.page_misses - before.page_misses));
+    printf("binary_search_probes: %llu\n",
+        (unsigned long long)(stats.binary_search_probes - before.binary_search_probes));
+    printf("hash_index_probes: %llu\n",
+        (unsigned long long)(stats.hash_index_probes - before.hash_index_probes));
+    printf("bytes_read: %llu\n", (unsigned long long)(stats.bytes_read - before.bytes_read));
+    printf("bytes_written: %llu\n", (unsigned long long)(stats.bytes_written - before.bytes_written));
+    printf("leaf_splits: %llu\n", (unsigned long long)(stats.leaf_splits - before.leaf_splits));
+    printf("root_splits: %llu\n", (unsigned long long)(stats.root_splits - before.root_splits));
+    printf("internal_node_inserts: %llu\n",
+        (unsigned long long)(stats.internal_node_inserts - before.internal_node_inserts));
+    printf("node_borrows: %llu\n", (unsigned long long)(stats.node_borrows - before.node_borrows));
+    printf("node_merges: %llu\n", (unsigned long long)(stats.node_merges - before.node_merges));
+    printf("root_collapses: %llu\n", (unsigned long long)(stats.root_collapses - before.root_collapses));
+}
+
+/*
+ * Delete / Update
+ */
+PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_DELETE;
+
+    char* keyword = next_token(input_buffer->buffer, " ");
+    if (strcmp(keyword, "delete") != 0) {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+
+    // 誤って全ての行を消さないように，whereは必須にする
+    char* where = next_token(NULL, " ");
+    if (where == NULL || strcmp(where, "where") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    return prepare_id_range(statement);
+}
+
+PrepareResult prepare_update(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_UPDATE;
+    statement->num_columns = 0;
+    // 列の余りの部分が前の文の値で埋まらないように，NULで初期化しておく
+    memset(&(statement->row_to_insert), 0, sizeof(Row));
+
+    char* keyword = next_token(input_buffer->buffer, " ");
+    if (strcmp(keyword, "update") != 0) {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    char* set = next_token(NULL, " ");
+    if (set == NULL || strcmp(set, "set") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    // 代入はカンマかスペースで区切る
+    // idはキーなので書き換えられない
+    char* token = next_token(NULL, " ,");
+    while (token != NULL && strcmp(token, "where") != 0) {
+        Column column;
+        char* equal = next_token(NULL, " ,");
+        char* value = next_token(NULL, " ,");
+        if (!parse_column(token, &column) || column == COLUMN_ID ||
+            equal == NULL || strcmp(equal, "=") != 0 || value == NULL ||
+            statement->num_columns >= MAX_SELECT_COLUMNS) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        if (column == COLUMN_USERNAME) {
+            if (strlen(value) > COLUMN_USERNAME_SIZE) {
+                return PREPARE_STRING_TOO_LONG;
+            }
+            strcpy(statement->row_to_insert.username, value);
+        } else {
+            if (strlen(value) > COLUMN_EMAIL_SIZE) {
+                return PREPARE_STRING_TOO_LONG;
             }
+            strcpy(statement->row_to_insert.email, value);
         }
+        statement->columns[statement->num_columns] = column;
+        statement->num_columns += 1;
 
-        pager->pages[page_num] = page;
+        token = next_token(NULL, " ,");
+    }
 
-        if (page_num >= pager->num_pages) {
-            pager->num_pages = page_num + 1;
+    if (statement->num_columns == 0 || token == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    return prepare_id_range(statement);
+}
+
+// where の後の id <op> N を読む
+// opは =, <, <=, >, >= に対応する
+PrepareResult prepare_id_range(Statement* statement) {
+    char* column = next_token(NULL, " ");
+    char* op = next_token(NULL, " ");
+    char* value = next_token(NULL, " ");
+
+    if (column == NULL || op == NULL || value == NULL || next_token(NULL, " ") != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (strcmp(column, "id") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (value[0] == '-' && value[1] != '\0' && strspn(value + 1, "0123456789") == strlen(value + 1)) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    if (value[0] == '\0' || strspn(value, "0123456789") != strlen(value)) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    uint32_t id = strtoul(value, NULL, 10);
+
+    statement->key_min = 0;
+    statement->key_max = UINT32_MAX;
+    if (strcmp(op, "=") == 0) {
+        statement->key_min = id;
+        statement->key_max = id;
+    } else if (strcmp(op, "<") == 0) {
+        if (id == 0) {
+            statement->key_min = 1;
+            statement->key_max = 0;
+        } else {
+            statement->key_max = id - 1;
+        }
+    } else if (strcmp(op, "<=") == 0) {
+        statement->key_max = id;
+    } else if (strcmp(op, ">") == 0) {
+        if (id == UINT32_MAX) {
+            statement->key_min = 1;
+            statement->key_max = 0;
+        } else {
+            statement->key_min = id + 1;
         }
+    } else if (strcmp(op, ">=") == 0) {
+        statement->key_min = id;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
     }
 
-    return pager->pages[page_num];
+    return PREPARE_SUCCESS;
 }
 
-void db_close(Table* table) {
-    Pager* pager = table->pager;
+// key以上で最小のキーを指すカーソルを返す
+// table_findは葉の末尾の次を指すことがあるので，その場合は次の葉の先頭に進める
+// キーが木にあれば索引から直接その位置を得る
+Cursor* table_seek(Table* table, uint32_t key) {
+    Cursor* cursor = hash_index_seek(table, key);
+    if (cursor != NULL) {
+        return cursor;
+    }
 
-    for (uint32_t i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
+    cursor = table_find(table, key);
+    void* node = get_page(table->pager, cursor->page_num);
+
+    cursor->end_of_table = false;
+    if (cursor->cell_num >= *leaf_node_num_cells(node)) {
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0) {
+            cursor->end_of_table = true;
+        } else {
+            cursor->page_num = next_page_num;
+            cursor->cell_num = 0;
         }
+    }
 
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+    return cursor;
+}
+
+// 書き込みバッファの行も対象にするため，先に木へ書き出しておく
+ExecuteResult execute_delete(Statement* statement, Table* table) {
+    if (table->write_buffer != NULL) {
+        write_buffer_flush(table);
+    }
+    if (statement->key_min > statement->key_max) {
+        return EXECUTE_SUCCESS;
     }
 
-    // ページの一部をファイルの終端に書き込む可能性がある
-    // b-treeの実装後は不要になる
-    // uint32_t num_additional_rows = table->num_rows % ROWS_PER_PAGE;
-    // if (num_additional_rows > 0) {
-    //     uint32_t page_num = num_full_pages;
-    //     if (pager->pages[page_num] != NULL) {
-    //         pager_flush(pager, page_num, num_additional_rows * ROW_SIZE);
-    //         free(pager->pages[page_num]);
+    // 削除するたびに木の形が変わるので，毎回探し直す
+    while (true) {
+        Cursor* cursor = table_seek(table, statement->key_min);
+        if (cursor->end_of_table || *cursor_key(cursor) > statement->key_max) {
+            free(cursor);
+            break;
+        }
+        leaf_node_delete(cursor);
+        free(cursor);
+    }
 
-    //         pager->pages[page_num] = NULL;
-    //     }
-    // }
+    return EXECUTE_SUCCESS;
+}
 
-    int result = close(pager->file_descriptor);
-    if (result == -1) {
-        printf("Error closing db file.\n");
-        exit(EXIT_FAILURE);
+// 行は固定長なので，その場で書き換える
+ExecuteResult execute_update(Statement* statement, Table* table) {
+    if (table->write_buffer != NULL) {
+        write_buffer_flush(table);
+    }
+    if (statement->key_min > statement->key_max) {
+        return EXECUTE_SUCCESS;
     }
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void* page = pager->pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = NULL;
+    Row* values = &(statement->row_to_insert);
+    Cursor* cursor = table_seek(table, statement->key_min);
+    while (!cursor->end_of_table && *cursor_key(cursor) <= statement->key_max) {
+        pager_mark_dirty(table->pager, cursor->page_num);
+
+        for (uint32_t i = 0; i < statement->num_columns; i++) {
+            if (statement->columns[i] == COLUMN_USERNAME) {
+                memcpy(cursor_username(cursor), values->username, USERNAME_SIZE);
+            } else {
+                memcpy(cursor_email(cursor), values->email, EMAIL_SIZE);
+            }
         }
+
+        cursor_advance(cursor);
     }
+    free(cursor);
 
-    free(pager);
-    free(table);
+    return EXECUTE_SUCCESS;
 }
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-    if (pager->pages[page_num] == NULL) {
-        printf("Tried to flush null page.\n");
-        exit(EXIT_FAILURE);
+// カーソルが指すセルを葉から取り除く
+// 親のキーは子の最大のキーより大きいままになることがあるが，
+// 子のキーの上限として使う分には問題ないので更新しない
+void leaf_node_delete(Cursor* cursor) {
+    Table* table = cursor->table;
+    void* node = get_page(table->pager, cursor->page_num);
+    pager_mark_dirty(table->pager, cursor->page_num);
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    hash_index_remove(table->pager, *leaf_node_key(node, cursor->cell_num));
+    leaf_node_copy_cells(node, cursor->cell_num, node, cursor->cell_num + 1, num_cells - cursor->cell_num - 1);
+    num_cells -= 1;
+    *leaf_node_num_cells(node) = num_cells;
+    // 空いたセルは0にしておく(圧縮しやすくなる)
+    leaf_node_clear_cells(node, num_cells, 1);
+    hash_index_update_leaf(table->pager, cursor->page_num, cursor->cell_num);
+
+    if (!is_node_root(node) && num_cells < LEAF_NODE_MIN_CELLS) {
+        node_rebalance(table, cursor->page_num);
+    }
+}
+
+uint32_t internal_node_child_index(void* node, uint32_t child_page_num) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+        if (*internal_node_child(node, i) == child_page_num) {
+            return i;
+        }
     }
 
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+    printf("Child page %d is not in its parent.\n", child_page_num);
+    exit(EXIT_FAILURE);
+}
 
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
+// 少なくなったノードを兄弟ノードと釣り合わせる
+// 兄弟に余裕があれば一つ借り，なければ併合して親から取り除く
+// 併合で親が少なくなれば，親についても繰り返す
+void node_rebalance(Table* table, uint32_t page_num) {
+    Pager* pager = table->pager;
+    void* node = get_page(pager, page_num);
+    uint32_t parent_page_num = *node_parent(node);
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t index = internal_node_child_index(parent, page_num);
+
+    // 右の兄弟があればそれと，なければ左の兄弟と組にする
+    uint32_t left_index = (index < num_keys) ? index : index - 1;
+    uint32_t left_page_num = *internal_node_child(parent, left_index);
+    uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+    bool from_left = (page_num == right_page_num);
+    void* sibling = get_page(pager, from_left ? left_page_num : right_page_num);
+
+    bool sibling_can_lend;
+    if (get_node_type(sibling) == NODE_LEAF) {
+        sibling_can_lend = *leaf_node_num_cells(sibling) > LEAF_NODE_MIN_CELLS;
+    } else {
+        sibling_can_lend = *internal_node_num_keys(sibling) > INTERNAL_NODE_MIN_KEYS;
+    }
+    if (sibling_can_lend) {
+        node_borrow(table, parent_page_num, left_index, from_left);
+        return;
     }
 
-    ssize_t bytes_written = 
-        write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+    node_merge(table, parent_page_num, left_index);
+    if (*internal_node_num_keys(parent) >= INTERNAL_NODE_MIN_KEYS) {
+        return;
+    }
+    if (is_node_root(parent)) {
+        collapse_root(table);
+    } else {
+        node_rebalance(table, parent_page_num);
+    }
+}
 
-    if (bytes_written == -1) {
-        printf("error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
+// 親のleft_index番目とその右隣の子の間で，セル(中間ノードなら子)を一つ移す
+// from_leftなら左から右へ，そうでなければ右から左へ移す
+void node_borrow(Table* table, uint32_t parent_page_num, uint32_t left_index, bool from_left) {
+    Pager* pager = table->pager;
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t left_page_num = *internal_node_child(parent, left_index);
+    uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+    void* left = get_page(pager, left_page_num);
+    void* right = get_page(pager, right_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    pager_mark_dirty(pager, left_page_num);
+    pager_mark_dirty(pager, right_page_num);
+    stats.node_borrows += 1;
+
+    if (get_node_type(left) == NODE_LEAF) {
+        uint32_t left_cells = *leaf_node_num_cells(left);
+        uint32_t right_cells = *leaf_node_num_cells(right);
+        if (from_left) {
+            leaf_node_copy_cells(right, 1, right, 0, right_cells);
+            leaf_node_copy_cells(right, 0, left, left_cells - 1, 1);
+            leaf_node_clear_cells(left, left_cells - 1, 1);
+            left_cells -= 1;
+            right_cells += 1;
+        } else {
+            leaf_node_copy_cells(left, left_cells, right, 0, 1);
+            leaf_node_copy_cells(right, 0, right, 1, right_cells - 1);
+            leaf_node_clear_cells(right, right_cells - 1, 1);
+            left_cells += 1;
+            right_cells -= 1;
+        }
+        *leaf_node_num_cells(left) = left_cells;
+        *leaf_node_num_cells(right) = right_cells;
+        *internal_node_key(parent, left_index) = *leaf_node_key(left, left_cells - 1);
+        hash_index_update_leaf(pager, left_page_num, 0);
+        hash_index_update_leaf(pager, right_page_num, 0);
+        return;
+    }
+
+    // 中間ノードでは，親のキーを間に挟んで子を一つ移す
+    uint32_t separator = *internal_node_key(parent, left_index);
+    uint32_t left_keys = *internal_node_num_keys(left);
+    uint32_t right_keys = *internal_node_num_keys(right);
+    uint32_t moved_page_num;
+    if (from_left) {
+        // 左の一番右の子を右の先頭へ
+        moved_page_num = *internal_node_right_child(left);
+        for (uint32_t i = right_keys; i > 0; i--) {
+            memcpy(internal_node_cell(right, i), internal_node_cell(right, i - 1), INTERNAL_NODE_CELL_SIZE);
+        }
+        *internal_node_cell(right, 0) = moved_page_num;
+        *internal_node_key(right, 0) = separator;
+        *internal_node_num_keys(right) = right_keys + 1;
+
+        // 左の最後のセルの子が一番右の子になる
+        *internal_node_key(parent, left_index) = *internal_node_key(left, left_keys - 1);
+        *internal_node_right_child(left) = *internal_node_cell(left, left_keys - 1);
+        *internal_node_num_keys(left) = left_keys - 1;
+    } else {
+        // 右の先頭の子を左の一番右へ
+        moved_page_num = *internal_node_cell(right, 0);
+        *internal_node_cell(left, left_keys) = *internal_node_right_child(left);
+        *internal_node_key(left, left_keys) = separator;
+        *internal_node_right_child(left) = moved_page_num;
+        *internal_node_num_keys(left) = left_keys + 1;
+
+        *internal_node_key(parent, left_index) = *internal_node_key(right, 0);
+        for (uint32_t i = 0; i + 1 < right_keys; i++) {
+            memcpy(internal_node_cell(right, i), internal_node_cell(right, i + 1), INTERNAL_NODE_CELL_SIZE);
+        }
+        *internal_node_num_keys(right) = right_keys - 1;
+    }
+
+    void* moved = get_page(pager, moved_page_num);
+    pager_mark_dirty(pager, moved_page_num);
+    *node_parent(moved) = from_left ? right_page_num : left_page_num;
+}
+
+// 親のleft_index番目の子に右隣の子を併合し，右隣の子を親から取り除く
+// 右隣の子のページは使われなくなる (.vacuumで回収できる)
+void node_merge(Table* table, uint32_t parent_page_num, uint32_t left_index) {
+    Pager* pager = table->pager;
+    void* parent = get_page(pager, parent_page_num);
+    uint32_t left_page_num = *internal_node_child(parent, left_index);
+    uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+    void* left = get_page(pager, left_page_num);
+    void* right = get_page(pager, right_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    pager_mark_dirty(pager, left_page_num);
+    stats.node_merges += 1;
+
+    if (get_node_type(left) == NODE_LEAF) {
+        uint32_t left_cells = *leaf_node_num_cells(left);
+        uint32_t right_cells = *leaf_node_num_cells(right);
+        leaf_node_copy_cells(left, left_cells, right, 0, right_cells);
+        *leaf_node_num_cells(left) = left_cells + right_cells;
+        *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+        hash_index_update_leaf(pager, left_page_num, left_cells);
+    } else {
+        // 親のキーを間に挟んで，右の子をすべて左へ移す
+        uint32_t left_keys = *internal_node_num_keys(left);
+        uint32_t right_keys = *internal_node_num_keys(right);
+        *internal_node_cell(left, left_keys) = *internal_node_right_child(left);
+        *internal_node_key(left, left_keys) = *internal_node_key(parent, left_index);
+        memcpy(internal_node_cell(left, left_keys + 1), internal_node_cell(right, 0), right_keys * INTERNAL_NODE_CELL_SIZE);
+        *internal_node_right_child(left) = *internal_node_right_child(right);
+        *internal_node_num_keys(left) = left_keys + 1 + right_keys;
+
+        for (uint32_t i = 0; i <= right_keys; i++) {
+            uint32_t child_page_num = *internal_node_child(right, i);
+            void* child = get_page(pager, child_page_num);
+            pager_mark_dirty(pager, child_page_num);
+            *node_parent(child) = left_page_num;
+        }
+    }
+
+    // 右の子を指していた所を左の子に付け替え，左の子のセルを取り除く
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    *internal_node_child(parent, left_index + 1) = left_page_num;
+    for (uint32_t i = left_index; i + 1 < num_keys; i++) {
+        memcpy(internal_node_cell(parent, i), internal_node_cell(parent, i + 1), INTERNAL_NODE_CELL_SIZE);
+    }
+    *internal_node_num_keys(parent) = num_keys - 1;
+}
+
+// 根が中間ノードで子が一つだけになったら，その子を根(ページ0)に移して木を一段低くする
+// 子のページは使われなくなる (.vacuumで回収できる)
+void collapse_root(Table* table) {
+    Pager* pager = table->pager;
+    void* root = get_page(pager, table->root_page_num);
+    uint32_t child_page_num = *internal_node_right_child(root);
+    void* child = get_page(pager, child_page_num);
+    pager_mark_dirty(pager, table->root_page_num);
+    stats.root_collapses += 1;
+
+    memcpy(root, child, PAGE_SIZE);
+    set_node_root(root, true);
+
+    if (get_node_type(root) == NODE_LEAF) {
+        hash_index_update_leaf(pager, table->root_page_num, 0);
+    } else {
+        uint32_t num_keys = *internal_node_num_keys(root);
+        for (uint32_t i = 0; i <= num_keys; i++) {
+            uint32_t grandchild_page_num = *internal_node_child(root, i);
+            void* grandchild = get_page(pager, grandchild_page_num);
+            pager_mark_dirty(pager, grandchild_page_num);
+            *node_parent(grandchild) = table->root_page_num;
+        }
     }
 }
 
@@ -667,7 +4542,7 @@ void pager_flush(Pager* pager, uint32_t page_num) {
 Cursor* table_start(Table* table) {
     Cursor* cursor = table_find(table, 0);
 
-    void* node = get_page(table->pager, cursor->page_num);
+    void* node = table_page(table, cursor->page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
     cursor->end_of_table = (num_cells == 0);
 
@@ -681,30 +4556,140 @@ Cursor* table_start(Table* table) {
  */
 Cursor* table_find(Table* table, uint32_t key) {
     uint32_t root_page_num = table->root_page_num;
-    void* root_node = get_page(table->pager, root_page_num);
+    void* root_node = table_page(table, root_page_num);
 
     if (get_node_type(root_node) == NODE_LEAF) {
         return leaf_node_find(table, root_page_num, key);
     } else {
         return internal_node_find(table, root_page_num, key);
     }
-}
+}
+
+void cursor_advance(Cursor* cursor) {
+    uint32_t page_num = cursor->page_num;
+    void* node = table_page(cursor->table, page_num);
+
+    cursor->cell_num += 1;
+    if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
+        // 次のノードへ進める
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0) {
+            // 木全体におけるもっとも右の葉ノード
+            cursor->end_of_table = true;
+        } else {
+            cursor->page_num = next_page_num;
+            cursor->cell_num = 0;
+            if (cursor->table->view != NULL) {
+                // スナップショットからの読み出しは文のロックの外なので，共有のpagesを見る間だけ取る
+                pthread_mutex_lock(&(cursor->table->pager->lock));
+                cursor_readahead(cursor, page_num);
+                pthread_mutex_unlock(&(cursor->table->pager->lock));
+            } else {
+                cursor_readahead(cursor, page_num);
+            }
+        }
+    }
+}
+
+/*
+ * Readahead
+ */
+// 葉を続けて辿っているなら，これから辿る葉をOSに先読みさせる
+// 次の葉の番号は親ノードの子の並びから分かるので，葉を読まなくても先に指示できる
+void cursor_readahead(Cursor* cursor, uint32_t leaf_page_num) {
+    cursor->leaf_hops += 1;
+    if (cursor->leaf_hops < READAHEAD_TRIGGER_HOPS) {
+        return;
+    }
+    if (cursor->readahead_remaining > 0) {
+        cursor->readahead_remaining -= 1;
+        return;
+    }
+
+    // 親ノードはここまで木を辿ってきた時にキャッシュに載っている
+    // 載っていなければ先読みのために読み込むことはしない
+    Pager* pager = cursor->table->pager;
+    void* leaf = pager->pages[leaf_page_num];
+    uint32_t parent_page_num = *node_parent(leaf);
+    if (parent_page_num >= TABLE_MAX_PAGES) {
+        return;
+    }
+    void* parent = pager->pages[parent_page_num];
+    if (parent == NULL || get_node_type(parent) != NODE_INTERNAL) {
+        return;
+    }
+
+    // 親の子のうち，今いる葉から右にあるものをwindow分だけ集める
+    uint32_t page_nums[READAHEAD_MAX_PAGES];
+    uint32_t count = 0;
+    bool found = false;
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    for (uint32_t i = 0; i <= num_keys && count < cursor->readahead_window; i++) {
+        uint32_t child_page_num = (i < num_keys) ?
+            *internal_node_child(parent, i) : *internal_node_right_child(parent);
+        if (child_page_num == cursor->page_num) {
+            found = true;
+        }
+        if (found) {
+            page_nums[count++] = child_page_num;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+
+    pager_readahead(pager, page_nums, count);
+    // 今いる葉の分を除いて，先読みした葉を辿り終えたら次を先読みする
+    cursor->readahead_remaining = count - 1;
+    cursor->readahead_window *= 2;
+    if (cursor->readahead_window > READAHEAD_MAX_PAGES) {
+        cursor->readahead_window = READAHEAD_MAX_PAGES;
+    }
+}
+
+// キャッシュにないページをposix_fadviseで先読みさせる
+// ファイル上で隣り合うページはまとめて一度に指示する
+void pager_readahead(Pager* pager, uint32_t* page_nums, uint32_t count) {
+    // O_DIRECTではページキャッシュに読み込ませても使われない
+    if (pager->direct_io) {
+        return;
+    }
 
-void cursor_advance(Cursor* cursor) {
-    uint32_t page_num = cursor->page_num;
-    void* node = get_page(cursor->table->pager, page_num);
+    off_t range_start = 0;
+    off_t range_end = 0;
 
-    cursor->cell_num += 1;
-    if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-        // 次のノードへ進める
-        uint32_t next_page_num = *leaf_node_next_leaf(node);
-        if (next_page_num == 0) {
-            // 木全体におけるもっとも右の葉ノード
-            cursor->end_of_table = true;
-        } else {
-            cursor->page_num = next_page_num;
-            cursor->cell_num = 0;
+    for (uint32_t i = 0; i <= count; i++) {
+        off_t start = 0;
+        off_t end = 0;
+        if (i < count) {
+            uint32_t page_num = page_nums[i];
+            if (page_num >= pager->num_pages || pager->pages[page_num] != NULL) {
+                continue;
+            }
+            if (pager->compressed) {
+                PageSlot* slot = &(pager->slots[page_num]);
+                if (slot->length == 0) {
+                    continue;
+                }
+                start = slot->offset;
+                end = start + slot->length;
+            } else {
+                start = pager_page_offset(pager, page_num);
+                end = start + PAGE_SIZE;
+            }
+            stats.readahead_pages += 1;
+
+            if (range_end != range_start && start == range_end) {
+                range_end = end;
+                continue;
+            }
+        }
+
+        if (range_end != range_start) {
+            posix_fadvise(pager->file_descriptor, range_start, range_end - range_start, POSIX_FADV_WILLNEED);
         }
+        range_start = start;
+        range_end = end;
     }
 }
 
@@ -713,20 +4698,105 @@ uint32_t* leaf_node_num_cells(void* node) {
     return node + LEAF_NODE_NUM_CELLS_OFFSET;
 }
 
+// 行形式の葉のセル (PAX形式の葉には使えない)
 void* leaf_node_cell(void* node, uint32_t cell_num) {
     return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
 }
 
+void* leaf_node_value(void* node, uint32_t cell_num) {
+    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+}
+
+LeafLayout leaf_node_layout(void* node) {
+    uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
+    return (value & NODE_FLAG_PAX) ? LEAF_LAYOUT_PAX : LEAF_LAYOUT_ROW;
+}
+
+// 各列のアクセサはどちらの形式の葉にも使える
 uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
+    if (leaf_node_layout(node) == LEAF_LAYOUT_PAX) {
+        return node + PAX_LEAF_NODE_KEYS_OFFSET + cell_num * LEAF_NODE_KEY_SIZE;
+    }
     return leaf_node_cell(node, cell_num);
 }
 
-void* leaf_node_value(void* node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+uint32_t* leaf_node_id(void* node, uint32_t cell_num) {
+    if (leaf_node_layout(node) == LEAF_LAYOUT_PAX) {
+        return node + PAX_LEAF_NODE_IDS_OFFSET + cell_num * ID_SIZE;
+    }
+    return leaf_node_value(node, cell_num) + ID_OFFSET;
+}
+
+char* leaf_node_username(void* node, uint32_t cell_num) {
+    if (leaf_node_layout(node) == LEAF_LAYOUT_PAX) {
+        return node + PAX_LEAF_NODE_USERNAMES_OFFSET + cell_num * USERNAME_SIZE;
+    }
+    return leaf_node_value(node, cell_num) + USERNAME_OFFSET;
+}
+
+char* leaf_node_email(void* node, uint32_t cell_num) {
+    if (leaf_node_layout(node) == LEAF_LAYOUT_PAX) {
+        return node + PAX_LEAF_NODE_EMAILS_OFFSET + cell_num * EMAIL_SIZE;
+    }
+    return leaf_node_value(node, cell_num) + EMAIL_OFFSET;
+}
+
+void leaf_node_read_row(void* node, uint32_t cell_num, Row* destination) {
+    if (leaf_node_layout(node) == LEAF_LAYOUT_ROW) {
+        deserialize_row(leaf_node_value(node, cell_num), destination);
+        return;
+    }
+    memcpy(&(destination->id), leaf_node_id(node, cell_num), ID_SIZE);
+    memcpy(&(destination->username), leaf_node_username(node, cell_num), USERNAME_SIZE);
+    memcpy(&(destination->email), leaf_node_email(node, cell_num), EMAIL_SIZE);
+}
+
+void leaf_node_write_cell(void* node, uint32_t cell_num, uint32_t key, Row* source) {
+    *leaf_node_key(node, cell_num) = key;
+    if (leaf_node_layout(node) == LEAF_LAYOUT_ROW) {
+        serialize_row(source, leaf_node_value(node, cell_num));
+        return;
+    }
+    memcpy(leaf_node_id(node, cell_num), &(source->id), ID_SIZE);
+    memcpy(leaf_node_username(node, cell_num), &(source->username), USERNAME_SIZE);
+    memcpy(leaf_node_email(node, cell_num), &(source->email), EMAIL_SIZE);
 }
 
-void initialize_leaf_node(void* node) {
+// sourceのsource_cellからcount個のセルをdestinationのdestination_cellへ移す
+// 同じ葉の中で範囲が重なっていてもよい
+// 同じファイルの葉は全て同じ形式なので，PAX形式では列ごとに連続した範囲を移すだけで済む
+void leaf_node_copy_cells(void* destination, uint32_t destination_cell, void* source, uint32_t source_cell,
+                          uint32_t count) {
+    if (leaf_node_layout(source) == LEAF_LAYOUT_ROW) {
+        memmove(leaf_node_cell(destination, destination_cell), leaf_node_cell(source, source_cell),
+                count * LEAF_NODE_CELL_SIZE);
+        return;
+    }
+    memmove(leaf_node_key(destination, destination_cell), leaf_node_key(source, source_cell),
+            count * LEAF_NODE_KEY_SIZE);
+    memmove(leaf_node_id(destination, destination_cell), leaf_node_id(source, source_cell), count * ID_SIZE);
+    memmove(leaf_node_username(destination, destination_cell), leaf_node_username(source, source_cell),
+            count * USERNAME_SIZE);
+    memmove(leaf_node_email(destination, destination_cell), leaf_node_email(source, source_cell),
+            count * EMAIL_SIZE);
+}
+
+void leaf_node_clear_cells(void* node, uint32_t cell_num, uint32_t count) {
+    if (leaf_node_layout(node) == LEAF_LAYOUT_ROW) {
+        memset(leaf_node_cell(node, cell_num), 0, count * LEAF_NODE_CELL_SIZE);
+        return;
+    }
+    memset(leaf_node_key(node, cell_num), 0, count * LEAF_NODE_KEY_SIZE);
+    memset(leaf_node_id(node, cell_num), 0, count * ID_SIZE);
+    memset(leaf_node_username(node, cell_num), 0, count * USERNAME_SIZE);
+    memset(leaf_node_email(node, cell_num), 0, count * EMAIL_SIZE);
+}
+
+void initialize_leaf_node(void* node, LeafLayout layout) {
     set_node_type(node, NODE_LEAF);
+    if (layout == LEAF_LAYOUT_PAX) {
+        *((uint8_t*)(node + NODE_TYPE_OFFSET)) |= NODE_FLAG_PAX;
+    }
     set_node_root(node, false);
     *leaf_node_num_cells(node) = 0;
     *leaf_node_next_leaf(node) = 0; // 0 represents no sibling
@@ -742,16 +4812,16 @@ void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
         return;
     }
 
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
+
     if (cursor->cell_num < num_cells) {
         // Make room for cell
-        for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
-        }
+        leaf_node_copy_cells(node, cursor->cell_num + 1, node, cursor->cell_num, num_cells - cursor->cell_num);
     }
 
     *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    leaf_node_write_cell(node, cursor->cell_num, key, value);
+    hash_index_update_leaf(cursor->table->pager, cursor->page_num, cursor->cell_num);
 }
 
 void print_constants() {
@@ -773,12 +4843,15 @@ void print_constants() {
 // }
 
 Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-    void* node = get_page(table->pager, page_num);
+    void* node = table_page(table, page_num);
     uint32_t num_cells = *leaf_node_num_cells(node);
 
     Cursor* cursor = malloc(sizeof(Cursor));
     cursor->table = table;
     cursor->page_num = page_num;
+    cursor->leaf_hops = 0;
+    cursor->readahead_window = READAHEAD_MIN_PAGES;
+    cursor->readahead_remaining = 0;
 
     // Binary search
     uint32_t min_index = 0;
@@ -787,6 +4860,7 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
     while (one_past_max_index != min_index) {
         uint32_t index = (min_index + one_past_max_index) / 2;
         uint32_t key_at_index = *leaf_node_key(node, index);
+        *search_probes += 1;
 
         if (key == key_at_index) {
             cursor->cell_num = index;
@@ -805,7 +4879,7 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
 
 NodeType get_node_type(void* node) {
     uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
-    return (NodeType)value;
+    return (NodeType)(value & NODE_TYPE_MASK);
 }
 
 void set_node_type(void* node, NodeType type) {
@@ -819,12 +4893,15 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
     Insert the new value in one of the two nodes.
     Update parent or create a new parent.
     */
+    stats.leaf_splits += 1;
 
     void* old_node = get_page(cursor->table->pager, cursor->page_num);
     uint32_t old_max = get_node_max_key(old_node);
     uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
     void* new_node = get_page(cursor->table->pager, new_page_num);
-    initialize_leaf_node(new_node);
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
+    pager_mark_dirty(cursor->table->pager, new_page_num);
+    initialize_leaf_node(new_node, leaf_node_layout(old_node));
     *node_parent(new_node) = *node_parent(old_node);
     *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
     *leaf_node_next_leaf(old_node) = new_page_num;
@@ -844,21 +4921,21 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
         }
 
         uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void* destination = leaf_node_cell(destination_node, index_within_node);
 
         if (i == cursor->cell_num) {
-            serialize_row(value, leaf_node_value(destination_node, index_within_node));
-            *leaf_node_key(destination_node, index_within_node) = key;
+            leaf_node_write_cell(destination_node, index_within_node, key, value);
         } else if (i > cursor->cell_num) {
-            memcpy(destination, leaf_node_cell(old_node, i-1), LEAF_NODE_CELL_SIZE);
+            leaf_node_copy_cells(destination_node, index_within_node, old_node, i-1, 1);
         } else {
-            memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+            leaf_node_copy_cells(destination_node, index_within_node, old_node, i, 1);
         }
     }
 
 /* Update cell count on both leaf nodes */
     *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
     *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    hash_index_update_leaf(cursor->table->pager, cursor->page_num, 0);
+    hash_index_update_leaf(cursor->table->pager, new_page_num, 0);
 
     if (is_node_root(old_node)) {
         return create_new_root(cursor->table, new_page_num);
@@ -867,6 +4944,7 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
         uint32_t new_max = get_node_max_key(old_node);
         void* parent = get_page(cursor->table->pager, parent_page_num);
 
+        pager_mark_dirty(cursor->table->pager, parent_page_num);
         update_internal_node_key(parent, old_max, new_max);
         internal_node_insert(cursor->table, parent_page_num, new_page_num);
         return;
@@ -889,14 +4967,21 @@ void create_new_root(Table* table, uint32_t right_child_page_num) {
     Re-initialize root page to contain the new root node.
     New root node points to two children.
     */
+    stats.root_splits += 1;
     void* root = get_page(table->pager, table->root_page_num);
     void* right_child = get_page(table->pager, right_child_page_num);
     uint32_t left_child_page_num = get_unused_page_num(table->pager);
     void* left_child = get_page(table->pager, left_child_page_num);
+    pager_mark_dirty(table->pager, table->root_page_num);
+    pager_mark_dirty(table->pager, right_child_page_num);
+    pager_mark_dirty(table->pager, left_child_page_num);
 
     /* Left child has data copied from old root */
     memcpy(left_child, root, PAGE_SIZE);
     set_node_root(left_child, false);
+    if (get_node_type(left_child) == NODE_LEAF) {
+        hash_index_update_leaf(table->pager, left_child_page_num, 0);
+    }
 
     /* Root node is a new internal node with one key and two children */
     initialize_internal_node(root);
@@ -1001,12 +5086,12 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
 }
 
 Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
-    void* node = get_page(table->pager, page_num);
+    void* node = table_page(table, page_num);
 
     uint32_t child_index = internal_node_find_child(node, key);
     uint32_t child_num = *internal_node_child(node, child_index);
 
-    void* child = get_page(table->pager, child_num);
+    void* child = table_page(table, child_num);
     switch (get_node_type(child)) {
         case NODE_LEAF:
             return leaf_node_find(table, child_num, key);
@@ -1028,6 +5113,7 @@ uint32_t internal_node_find_child(void* node, uint32_t key) {
     while (min_index != max_index) {
         uint32_t index = (min_index + max_index) / 2;
         uint32_t key_to_right = *internal_node_key(node, index);
+        *search_probes += 1;
         if (key_to_right >= key) {
             max_index = index;
         } else {
@@ -1055,12 +5141,14 @@ void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child
     /*
     子に対応するchild/keyのペアを親ノードへ追加する
     */
+    stats.internal_node_inserts += 1;
     void* parent = get_page(table->pager, parent_page_num);
     void* child = get_page(table->pager, child_page_num);
 
     uint32_t child_max_key = get_node_max_key(child);
     uint32_t index = internal_node_find_child(parent, child_max_key);
 
+    pager_mark_dirty(table->pager, parent_page_num);
     uint32_t original_num_keys = *internal_node_num_keys(parent);
     *internal_node_num_keys(parent) = original_num_keys + 1;
 
@@ -1089,14 +5177,625 @@ void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child
     }
 }
 
+// ベンチマークなどからエンジンだけを使う場合は，DB_NO_MAINを定義してこのファイルをincludeする
+/*
+ * Server
+ */
+FILE* output() {
+    return statement_output != NULL ? statement_output : stdout;
+}
+
+char* next_token(char* s, const char* delimiters) {
+    return strtok_r(s, delimiters, &token_position);
+}
+
+void byte_buffer_append(ByteBuffer* buffer, const void* data, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity == 0 ? 256 : buffer->capacity;
+        while (buffer->length + length > capacity) {
+            capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+void byte_buffer_free(ByteBuffer* buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+// サーバーを終了させるシグナル
+void server_signals(sigset_t* signals) {
+    sigemptyset(signals);
+    sigaddset(signals, SIGINT);
+    sigaddset(signals, SIGTERM);
+}
+
+// 一つのプロセスがpagerを持ち，Unixドメインソケットで複数のクライアントの文を実行する
+// 接続の読み書きはepollのイベントループで行い，文の解析と実行はワーカーに任せる
+// 文の実行はpager->lockで一つずつになるが，接続ごとにプロセスを起動してdb_openするよりずっと速い
+void serve(Table* table, const char* socket_path) {
+    Server* server = calloc(1, sizeof(Server));
+    server->table = table;
+    pthread_mutex_init(&(server->lock), NULL);
+    pthread_cond_init(&(server->job_ready), NULL);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Socket path is too long.\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, socket_path);
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(socket_path);
+    if (server->listen_fd == -1 ||
+        bind(server->listen_fd, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+        listen(server->listen_fd, SERVER_LISTEN_BACKLOG) == -1) {
+        printf("Unable to listen on %s: %d\n", socket_path, errno);
+        exit(EXIT_FAILURE);
+    }
+
+    // シグナルはmainで全てのスレッドを作る前にブロックしてある
+    sigset_t signals;
+    server_signals(&signals);
+    server->signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    server->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->signal_fd == -1 || server->event_fd == -1 || server->epoll_fd == -1) {
+        printf("Unable to start server: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    // 接続以外のfdは，Serverのフィールドのアドレスで区別する
+    int* fds[] = {&(server->listen_fd), &(server->event_fd), &(server->signal_fd)};
+    for (uint32_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = fds[i]};
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, *fds[i], &event);
+    }
+
+    for (uint32_t i = 0; i < SERVER_WORKERS; i++) {
+        if (pthread_create(&(server->workers[i]), NULL, server_worker_main, server) != 0) {
+            printf("Unable to start server worker\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Listening on %s\n", socket_path);
+    fflush(stdout);
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    bool running = true;
+    while (running) {
+        int num_events = epoll_wait(server->epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if (num_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error waiting for events: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            void* source = events[i].data.ptr;
+            if (source == &(server->listen_fd)) {
+                server_accept(server);
+            } else if (source == &(server->event_fd)) {
+                uint64_t count;
+                read(server->event_fd, &count, sizeof(count));
+                server_complete_jobs(server);
+            } else if (source == &(server->signal_fd)) {
+                running = false;
+            } else {
+                Connection* connection = source;
+                if (connection->closed) {
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    server_write(server, connection);
+                    server_close_if_finished(server, connection);
+                }
+                if (!connection->closed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                    server_read(server, connection);
+                }
+            }
+        }
+        server_free_closed(server);
+    }
+
+    // 受け付けた文は実行してから終わる
+    pthread_mutex_lock(&(server->lock));
+    server->stopping = true;
+    pthread_cond_broadcast(&(server->job_ready));
+    pthread_mutex_unlock(&(server->lock));
+    for (uint32_t i = 0; i < SERVER_WORKERS; i++) {
+        pthread_join(server->workers[i], NULL);
+    }
+    server_complete_jobs(server);
+    for (Connection* connection = server->connections; connection != NULL; connection = connection->next) {
+        if (!connection->closed) {
+            server_drop_connection(server, connection);
+        }
+    }
+    server_free_closed(server);
+
+    close(server->listen_fd);
+    close(server->event_fd);
+    close(server->signal_fd);
+    close(server->epoll_fd);
+    unlink(socket_path);
+    pthread_mutex_destroy(&(server->lock));
+    pthread_cond_destroy(&(server->job_ready));
+    free(server);
+
+    db_close(table);
+}
+
+void server_accept(Server* server) {
+    while (true) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            // EAGAIN: 待っている接続がもうない
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        Connection* connection = calloc(1, sizeof(Connection));
+        connection->fd = fd;
+        connection->next = server->connections;
+        server->connections = connection;
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+void server_read(Server* server, Connection* connection) {
+    // 送信を終えた後にさらに通知されるのは，相手が接続ごと閉じたかエラーの時
+    if (connection->read_closed) {
+        server_drop_connection(server, connection);
+        return;
+    }
+
+    char buffer[65536];
+    while (true) {
+        ssize_t bytes_read = read(connection->fd, buffer, sizeof(buffer));
+        if (bytes_read > 0) {
+            byte_buffer_append(&(connection->in), buffer, bytes_read);
+            continue;
+        }
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        }
+        if (bytes_read == 0) {
+            // 相手が送信を終えた (shutdown(SHUT_WR))．受信済みの要求は処理して応答を返す
+            // EOFはレベルトリガーで通知され続けるので，EPOLLINは待たない
+            connection->read_closed = true;
+            server_watch(server, connection);
+            break;
+        }
+        // エラー
+        server_drop_connection(server, connection);
+        return;
+    }
+
+    server_dispatch(server, connection);
+    server_close_if_finished(server, connection);
+}
+
+void server_write(Server* server, Connection* connection) {
+    ByteBuffer* out = &(connection->out);
+    while (connection->out_position < out->length) {
+        // 相手が閉じていてもSIGPIPEで終了しないようにする
+        ssize_t bytes_written = send(connection->fd, out->data + connection->out_position,
+                                     out->length - connection->out_position, MSG_NOSIGNAL);
+        if (bytes_written > 0) {
+            connection->out_position += bytes_written;
+            continue;
+        }
+        if (bytes_written == -1 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        }
+        server_drop_connection(server, connection);
+        return;
+    }
+
+    bool pending = connection->out_position < out->length;
+    if (!pending) {
+        out->length = 0;
+        connection->out_position = 0;
+    }
+    // 送りきれなかった時だけ書き込めるようになるのを待つ
+    if (pending != connection->want_write) {
+        connection->want_write = pending;
+        server_watch(server, connection);
+    }
+}
+
+// 待つイベントを接続の状態に合わせる
+void server_watch(Server* server, Connection* connection) {
+    uint32_t events = (connection->read_closed ? 0 : EPOLLIN) | (connection->want_write ? EPOLLOUT : 0);
+    struct epoll_event event = {.events = events, .data.ptr = connection};
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+// 送信を終えた相手は，処理中の束がなく応答も送りきったら閉じる
+// 最後の不完全なフレームはもう完成しないので捨てる
+void server_close_if_finished(Server* server, Connection* connection) {
+    if (!connection->read_closed || connection->closed || connection->busy) {
+        return;
+    }
+    if (connection->out_position < connection->out.length) {
+        return;
+    }
+    server_drop_connection(server, connection);
+}
+
+// 受信し終わった要求をまとめてワーカーに渡す
+// 処理中の束があれば，それが終わってから次の束を渡す
+void server_dispatch(Server* server, Connection* connection) {
+    if (connection->busy || connection->closed) {
+        return;
+    }
+
+    ByteBuffer* in = &(connection->in);
+    size_t length = 0;
+    while (length + SERVER_FRAME_HEADER_SIZE <= in->length) {
+        uint32_t request_length;
+        memcpy(&request_length, in->data + length, SERVER_FRAME_HEADER_SIZE);
+        if (request_length > SERVER_MAX_REQUEST_SIZE) {
+            server_drop_connection(server, connection);
+            return;
+        }
+        if (length + SERVER_FRAME_HEADER_SIZE + request_length > in->length) {
+            break;
+        }
+        length += SERVER_FRAME_HEADER_SIZE + request_length;
+    }
+    if (length == 0) {
+        return;
+    }
+
+    ServerJob* job = calloc(1, sizeof(ServerJob));
+    job->connection = connection;
+    byte_buffer_append(&(job->requests), in->data, length);
+    memmove(in->data, in->data + length, in->length - length);
+    in->length -= length;
+    connection->busy = true;
+
+    pthread_mutex_lock(&(server->lock));
+    if (server->jobs_tail == NULL) {
+        server->jobs = job;
+    } else {
+        server->jobs_tail->next = job;
+    }
+    server->jobs_tail = job;
+    pthread_cond_signal(&(server->job_ready));
+    pthread_mutex_unlock(&(server->lock));
+}
+
+// ワーカーが処理を終えた束の応答を送る
+void server_complete_jobs(Server* server) {
+    pthread_mutex_lock(&(server->lock));
+    ServerJob* job = server->done;
+    server->done = NULL;
+    pthread_mutex_unlock(&(server->lock));
+
+    while (job != NULL) {
+        ServerJob* next = job->next;
+        Connection* connection = job->connection;
+        connection->busy = false;
+        if (!connection->closed) {
+            byte_buffer_append(&(connection->out), job->response.data, job->response.length);
+            server_write(server, connection);
+            // 処理中に届いた要求
+            server_dispatch(server, connection);
+            server_close_if_finished(server, connection);
+        }
+        byte_buffer_free(&(job->requests));
+        byte_buffer_free(&(job->response));
+        free(job);
+        job = next;
+    }
+}
+
+// 同じepoll_waitの結果に残っているイベントが参照するかもしれないので，ここでは解放しない
+void server_drop_connection(Server* server, Connection* connection) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    connection->fd = -1;
+    connection->closed = true;
+}
+
+void server_free_closed(Server* server) {
+    Connection** link = &(server->connections);
+    while (*link != NULL) {
+        Connection* connection = *link;
+        if (connection->closed && !connection->busy) {
+            *link = connection->next;
+            // .snapshot endせずに切れた接続のスナップショット
+            if (connection->snapshot != NULL) {
+                pthread_mutex_lock(&(server->table->pager->lock));
+                snapshot_close(server->table, connection->snapshot);
+                pthread_mutex_unlock(&(server->table->pager->lock));
+            }
+            byte_buffer_free(&(connection->in));
+            byte_buffer_free(&(connection->out));
+            free(connection);
+        } else {
+            link = &(connection->next);
+        }
+    }
+}
+
+void* server_worker_main(void* arg) {
+    Server* server = arg;
+    InputBuffer* input_buffer = new_input_buffer();
+
+    while (true) {
+        pthread_mutex_lock(&(server->lock));
+        while (server->jobs == NULL && !server->stopping) {
+            pthread_cond_wait(&(server->job_ready), &(server->lock));
+        }
+        ServerJob* job = server->jobs;
+        if (job == NULL) {
+            pthread_mutex_unlock(&(server->lock));
+            break;
+        }
+        server->jobs = job->next;
+        if (server->jobs == NULL) {
+            server->jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&(server->lock));
+
+        server_run_job(server, job, input_buffer);
+
+        pthread_mutex_lock(&(server->lock));
+        job->next = server->done;
+        server->done = job;
+        pthread_mutex_unlock(&(server->lock));
+        uint64_t one = 1;
+        write(server->event_fd, &one, sizeof(one));
+    }
+
+    close_input_buffer(input_buffer);
+    return NULL;
+}
+
+// 束の中の文を順に実行し，出力を応答にする
+void server_run_job(Server* server, ServerJob* job, InputBuffer* input_buffer) {
+    char* output_data = NULL;
+    size_t output_length = 0;
+    FILE* stream = open_memstream(&output_data, &output_length);
+
+    size_t position = 0;
+    while (position < job->requests.length) {
+        uint32_t length;
+        memcpy(&length, job->requests.data + position, SERVER_FRAME_HEADER_SIZE);
+        position += SERVER_FRAME_HEADER_SIZE;
+
+        // 文の解析でバッファを書き換えるので，NUL終端してコピーする
+        if (input_buffer->buffer_length < length + 1) {
+            input_buffer->buffer = realloc(input_buffer->buffer, length + 1);
+            input_buffer->buffer_length = length + 1;
+        }
+        memcpy(input_buffer->buffer, job->requests.data + position, length);
+        input_buffer->buffer[length] = '\0';
+        input_buffer->input_length = length;
+        position += length;
+
+        rewind(stream);
+        statement_output = stream;
+        // スナップショットは接続ごとに持つので，その接続のものを設定した表の複製で実行する
+        Table table = *(server->table);
+        table.snapshot = job->connection->snapshot;
+        if (strcmp(input_buffer->buffer, ".snapshot begin") == 0 ||
+            strcmp(input_buffer->buffer, ".snapshot end") == 0) {
+            snapshot_command(input_buffer, &table);
+            job->connection->snapshot = table.snapshot;
+        } else if (input_buffer->buffer[0] == '.') {
+            // .exitや.vacuumは他の接続にも影響するので受け付けない
+            fprintf(output(), "Error: Meta commands are not supported by the server.\n");
+        } else {
+            run_statement(input_buffer, &table);
+        }
+        statement_output = NULL;
+        fflush(stream);
+
+        uint32_t response_length = output_length;
+        byte_buffer_append(&(job->response), &response_length, SERVER_FRAME_HEADER_SIZE);
+        byte_buffer_append(&(job->response), output_data, output_length);
+    }
+
+    fclose(stream);
+    free(output_data);
+}
+
+// --connect: 標準入力の一行を一つの要求としてサーバーに送り，応答を表示する
+// CLIENT_PIPELINE_DEPTH行ずつ，応答を待たずにまとめて送る
+int client_main(const char* socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Socket path is too long.\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+        printf("Unable to connect to %s: %d\n", socket_path, errno);
+        exit(EXIT_FAILURE);
+    }
+
+    char* line = NULL;
+    size_t line_capacity = 0;
+    ByteBuffer requests = {0};
+    char* response = NULL;
+    bool end_of_input = false;
+    while (!end_of_input) {
+        uint32_t num_requests = 0;
+        requests.length = 0;
+        while (num_requests < CLIENT_PIPELINE_DEPTH) {
+            ssize_t bytes_read = getline(&line, &line_capacity, stdin);
+            if (bytes_read <= 0) {
+                end_of_input = true;
+                break;
+            }
+            uint32_t length = line[bytes_read - 1] == '\n' ? bytes_read - 1 : bytes_read;
+            if (length == 0) {
+                continue;
+            }
+            if (length == 5 && strncmp(line, ".exit", 5) == 0) {
+                end_of_input = true;
+                break;
+            }
+            if (length > SERVER_MAX_REQUEST_SIZE) {
+                printf("String is too long.\n");
+                continue;
+            }
+            byte_buffer_append(&requests, &length, SERVER_FRAME_HEADER_SIZE);
+            byte_buffer_append(&requests, line, length);
+            num_requests++;
+        }
+
+        if (!write_full(fd, requests.data, requests.length)) {
+            printf("Error writing request: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t i = 0; i < num_requests; i++) {
+            uint32_t length;
+            if (!read_full(fd, &length, SERVER_FRAME_HEADER_SIZE)) {
+                printf("Error reading response: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            response = realloc(response, length);
+            if (!read_full(fd, response, length)) {
+                printf("Error reading response: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            fwrite(response, 1, length, stdout);
+        }
+    }
+
+    free(line);
+    free(response);
+    byte_buffer_free(&requests);
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+bool read_full(int fd, void* buffer, size_t length) {
+    size_t position = 0;
+    while (position < length) {
+        ssize_t bytes_read = read(fd, (char*)buffer + position, length - position);
+        if (bytes_read <= 0) {
+            if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        position += bytes_read;
+    }
+    return true;
+}
+
+bool write_full(int fd, const void* buffer, size_t length) {
+    size_t position = 0;
+    while (position < length) {
+        ssize_t bytes_written = write(fd, (const char*)buffer + position, length - position);
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        position += bytes_written;
+    }
+    return true;
+}
+
+#ifndef DB_NO_MAIN
 int main(int argc, char* argv[]) {
+    // ./db --connect <socket>: --serveで起動したサーバーに文を送る
+    if (argc == 3 && strcmp(argv[1], "--connect") == 0) {
+        return client_main(argv[2]);
+    }
+
     if (argc < 2) {
         printf("Must supply a database filename.\n");
         exit(EXIT_FAILURE);
     }
 
     char* filename = argv[1];
-    Table* table = db_open(filename);
+    bool use_write_buffer = false;
+    bool use_background_writer = false;
+    uint32_t flags = 0;
+    const char* socket_path = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--write-buffer") == 0) {
+            use_write_buffer = true;
+        } else if (strcmp(argv[i], "--background-writer") == 0) {
+            use_background_writer = true;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            flags |= DB_OPEN_COMPRESSED;
+        } else if (strcmp(argv[i], "--direct-io") == 0) {
+            flags |= DB_OPEN_DIRECT_IO;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            flags |= DB_OPEN_HUGE_PAGES;
+        } else if (strcmp(argv[i], "--pax") == 0) {
+            flags |= DB_OPEN_PAX_LEAVES;
+        } else if (strcmp(argv[i], "--hash-index") == 0) {
+            flags |= DB_OPEN_HASH_INDEX;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_json_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace.file = fopen(argv[++i], "wb");
+            if (trace.file == NULL) {
+                printf("Unable to open trace file\n");
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            printf("Unrecognized option '%s'.\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // --serveはSIGINT, SIGTERMをsignalfdで受け取って閉じてから終わる
+    // 書き込みスレッドやワーカーが受け取って既定の動作で終了しないように，スレッドを作る前にブロックする
+    if (socket_path != NULL) {
+        sigset_t signals;
+        server_signals(&signals);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    }
+
+    Table* table = db_open(filename, flags);
+    if (use_write_buffer) {
+        table->write_buffer = new_write_buffer(table);
+    }
+    if (use_background_writer) {
+        pager_start_writer(table->pager);
+    }
+
+    if (socket_path != NULL) {
+        serve(table, socket_path);
+        if (stats_json_path != NULL) {
+            write_stats_json(stats_json_path);
+        }
+        trace_close();
+        exit(EXIT_SUCCESS);
+    }
 
     InputBuffer* input_buffer = new_input_buffer();
     while(true) {
@@ -1114,34 +5813,7 @@ int main(int argc, char* argv[]) {
             }
         }
 
-        Statement statement;
-        switch (prepare_statement(input_buffer, &statement)) {
-            case (PREPARE_SUCCESS):
-                break;
-            case (PREPARE_NEGATIVE_ID):
-                printf("ID must be positive.\n");
-                continue;
-            case (PREPARE_STRING_TOO_LONG):
-                printf("String is too long.\n");
-                continue;
-            case (PREPARE_SYNTAX_ERROR):
-                printf("Syntax error. Could not parse statement.\n");
-                continue;
-            case (PREPARE_UNRECOGNIZED_STATEMENT):
-                printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
-                continue;
-        }
-
-        switch (execute_statement(&statement, table)) {
-            case (EXECUTE_SUCCESS):
-                printf("Executed.\n");
-                break;
-            case (EXECUTE_DUPLICATE_KEY):
-                printf("Error: Duplicate key.\n");
-                break;
-            case (EXECUTE_TABLE_FULL):
-                printf("Error: Table full.\n");
-                break;
-        }
+        run_statement(input_buffer, table);
     }
 }
+#endif
@@ -1,12 +1,15 @@
+require "json"
+require "socket"
+
 describe "database" do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db-hot test.db-changed test.sock backup.db backup.db-hot`
   end
 
-  def run_script(commands)
+  def run_script(commands, options = "")
     raw_output = nil
     # サブプロセスを実行
-    IO.popen("./db test.db", "r+") do |pipe|
+    IO.popen("./db test.db #{options}", "r+") do |pipe|
       commands.each do |command|
         begin
           pipe.puts command
@@ -257,6 +260,807 @@ describe "database" do
     ])
   end
 
+  it 'prints only the selected columns' do
+    script = (1..15).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select id"
+    script << "select id, email"
+    script << "select username id"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[15...result.length]).to match_array([
+      "db > (1)",
+      *(2..15).map { |i| "(#{i})" },
+      "Executed.",
+      "db > (1, person1@example.com)",
+      *(2..15).map { |i| "(#{i}, person#{i}@example.com)" },
+      "Executed.",
+      "db > (user1, 1)",
+      *(2..15).map { |i| "(user#{i}, #{i})" },
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'prints an error message if an unknown column is selected' do
+    script = [
+      "insert 1 user1 person1@example.com",
+      "select id, password",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'filters rows by string columns' do
+    script = [
+      "insert 1 alice alice@corp.com",
+      "insert 2 bob bob@example.com",
+      "insert 3 carol carol@corp.com",
+      "insert 4 alicia alicia@example.com",
+      "select where email like %@corp.com",
+      "select id where username like ali%",
+      "select id, username where username like %ro%",
+      "select where email = bob@example.com",
+      "select where username = ali",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result[4...result.length]).to match_array([
+      "db > (1, alice, alice@corp.com)",
+      "(3, carol, carol@corp.com)",
+      "Executed.",
+      "db > (1)",
+      "(4)",
+      "Executed.",
+      "db > (3, carol)",
+      "Executed.",
+      "db > (2, bob, bob@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'prints an error message if a where clause is malformed' do
+    script = [
+      "select where id = 1",
+      "select where email ~ foo",
+      "select where username like #{"a" * 33}",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result).to match_array([
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > String is too long.",
+      "db > ",
+    ])
+  end
+
+  it 'orders rows by a column with a limit' do
+    script = [
+      "insert 1 carol carol@example.com",
+      "insert 2 alice alice@example.com",
+      "insert 3 bob bob@example.com",
+      "insert 4 alice alice2@example.com",
+      "select id, username order by username",
+      "select id, email order by email desc limit 2",
+      "select id where email like %2@example.com order by username limit 5",
+      "select id limit 1",
+      ".exit",
+    ]
+    result = run_script(script)
+
+    expect(result[4...result.length]).to eq([
+      "db > (2, alice)",
+      "(4, alice)",
+      "(3, bob)",
+      "(1, carol)",
+      "Executed.",
+      "db > (1, carol@example.com)",
+      "(3, bob@example.com)",
+      "Executed.",
+      "db > (4)",
+      "Executed.",
+      "db > (1)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'buffers inserts and merges them with the tree' do
+    ids = [18, 7, 10, 29, 23, 4, 14, 30, 15, 26, 22, 19, 2, 1, 21]
+    script = ids.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "insert 7 user7 person7@example.com"
+    script << "select id"
+    script << ".exit"
+    result = run_script(script, "--write-buffer")
+
+    expect(result[ids.length..result.length]).to eq([
+      "db > Error: Duplicate key.",
+      "db > (1)",
+      *ids.sort.drop(1).map { |i| "(#{i})" },
+      "Executed.",
+      "db > ",
+    ])
+
+    result = run_script([
+      "insert 10 user10 person10@example.com",
+      "select id",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Error: Duplicate key.",
+      "db > (1)",
+      *ids.sort.drop(1).map { |i| "(#{i})" },
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps data in a compressed database file' do
+    script = (1..15).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--compress")
+
+    # 3ページ分(12288バイト)よりずっと小さくなる
+    expect(File.size("test.db") < 4096).to eq(true)
+
+    result = run_script([
+      "select id, email where username = user15",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > (15, person15@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'reads and writes pages with direct I/O' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--direct-io --huge-pages")
+
+    result = run_script([
+      "select id, email where username = user20",
+      ".exit",
+    ], "--direct-io")
+    expect(result).to eq([
+      "db > (20, person20@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+
+    `rm -rf test.db test.db-hot`
+    result = run_script([".exit"], "--compress --direct-io")
+    expect(result).to eq([
+      "Direct I/O cannot be used with a compressed database file.",
+    ])
+  end
+
+  it 'stores the columns of each leaf in separate minipages with --pax' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "update set email = changed@example.com where id = 7"
+    script << "delete where id > 10"
+    script << ".exit"
+    run_script(script, "--pax")
+
+    result = run_script([
+      "select where email like changed%",
+      "select id, username order by username desc limit 2",
+      ".vacuum",
+      "select id where username like %0",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > (7, user7, changed@example.com)",
+      "Executed.",
+      "db > (9, user9)",
+      "(8, user8)",
+      "Executed.",
+      "db > Before: 3 pages, 1 leaves, 0 of 0 leaf hops out of order (0.0%)",
+      "Vacuumed 10 rows into 1 leaves (fill 90%).",
+      "After: 1 pages, 1 leaves, 0 of 0 leaf hops out of order (0.0%)",
+      "db > (10)",
+      "Executed.",
+      "db > ",
+    ])
+
+    `rm -rf test.db test.db-hot`
+    run_script([".exit"])
+    result = run_script([".exit"], "--pax")
+    expect(result).to eq([
+      "PAX layout can only be enabled on a new database file.",
+    ])
+  end
+
+  it 'looks up ids through a hash index with --hash-index' do
+    script = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--hash-index")
+
+    result = run_script([
+      ".explain insert 3 dup dup",
+      "delete where id = 5",
+      ".vacuum",
+      ".explain update set username = x where id = 12",
+      "insert 5 user5 person5@example.com",
+      "insert 12 dup dup",
+      "select id, username where username = x",
+      ".exit",
+    ])
+    # 重複はバケットを一つ見るだけでわかる
+    expect(result[0..4]).to eq([
+      "db > Error: Duplicate key.",
+      "Explain:",
+      "- page 1 hash hit",
+      "- page 2 hash hit",
+      "page_requests: 2",
+    ])
+    expect(result.include?("Vacuumed 13 rows into 2 leaves (fill 90%).")).to eq(true)
+
+    # 木を辿らずに葉へ直接進む
+    update = result[(result.index { |line| line.start_with?("After:") } + 1)..-1]
+    expect(update[1..3]).to eq([
+      "Explain:",
+      "- page 1 hash miss",
+      "- page 4 hash miss",
+    ])
+    expect(update.include?("binary_search_probes: 0")).to eq(true)
+    expect(update.include?("hash_index_probes: 1")).to eq(true)
+    expect(result.last(5)).to eq([
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > (12, x)",
+      "Executed.",
+      "db > ",
+    ])
+
+    `rm -rf test.db test.db-hot`
+    run_script([".exit"])
+    result = run_script([".exit"], "--hash-index")
+    expect(result).to eq([
+      "Hash index can only be enabled on a new database file.",
+    ])
+  end
+
+  it 'prints and resets stats' do
+    script = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".stats"
+    script << ".stats reset"
+    script << "select id where username = user3"
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script, "--stats-json test.json")
+
+    stats = result[14...result.length].join("\n")
+    expect(stats.include?("leaf_splits: 1\nroot_splits: 1")).to eq(true)
+    expect(stats.include?("insert: count 14,")).to eq(true)
+    expect(stats.include?("leaf_splits: 0\nroot_splits: 0")).to eq(true)
+    expect(stats.include?("insert: count 0,")).to eq(true)
+    expect(stats.include?("select: count 1,")).to eq(true)
+
+    json = JSON.parse(File.read("test.json"))
+    expect(json["pages_written"]).to eq(3)
+    expect(json["latency"]["select"]["count"]).to eq(1)
+  ensure
+    `rm -f test.json`
+  end
+
+  it 'writes dirty pages in the background and only dirty pages on close' do
+    script = (1..30).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--background-writer")
+
+    result = run_script([
+      "select id where username = user30",
+      ".exit",
+    ], "--stats-json test.json")
+    expect(result).to eq([
+      "db > (30)",
+      "Executed.",
+      "db > ",
+    ])
+
+    # 読んだだけのページは書き出さない
+    json = JSON.parse(File.read("test.json"))
+    expect(json["pages_written"]).to eq(0)
+  ensure
+    `rm -f test.json`
+  end
+
+  it 'reads ahead leaves during a scan' do
+    script = (1..34).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+    # 先に読み込まれないように，キャッシュの記録を消しておく
+    File.delete("test.db-hot")
+
+    result = run_script([
+      "select id where username = user34",
+      ".exit",
+    ], "--stats-json test.json")
+    expect(result).to eq([
+      "db > (34)",
+      "Executed.",
+      "db > ",
+    ])
+
+    # 4つの葉のうち，2回目に葉を移った時に残りの2つを先読みする
+    json = JSON.parse(File.read("test.json"))
+    expect(json["readahead_pages"]).to eq(2)
+  ensure
+    `rm -f test.json`
+  end
+
+  it 'preloads the pages that were cached when the database was closed' do
+    script = (1..34).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      "select id where username = user34",
+      ".exit",
+    ], "--stats-json test.json")
+    expect(result).to eq([
+      "db > (34)",
+      "Executed.",
+      "db > ",
+    ])
+
+    json = JSON.parse(File.read("test.json"))
+    expect(json["preloaded_pages"]).to eq(5)
+    expect(json["page_misses"]).to eq(0)
+  ensure
+    `rm -f test.json`
+  end
+
+  it 'vacuums the table into leaves in key order' do
+    ids = [18, 7, 10, 29, 23, 4, 14, 30, 15, 26, 22, 19, 2, 1, 21, 11, 6, 20, 5, 8, 9, 3, 12, 27, 17, 16, 13, 24, 25, 28]
+    script = ids.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".vacuum 101"
+    script << ".vacuum"
+    script << "insert 31 user31 person31@example.com"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[ids.length..result.length]).to eq([
+      "db > Error: Fill factor must be between 10 and 100.",
+      "db > Before: 5 pages, 4 leaves, 2 of 3 leaf hops out of order (66.7%)",
+      "Vacuumed 30 rows into 3 leaves (fill 90%).",
+      "After: 4 pages, 3 leaves, 0 of 2 leaf hops out of order (0.0%)",
+      "db > Executed.",
+      "db > ",
+    ])
+
+    result = run_script([
+      "select id",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > (1)",
+      *(2..31).map { |i| "(#{i})" },
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'records the file format in a header and converts legacy files' do
+    script = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    # ヘッダの後ろに3ページが並ぶ
+    expect(File.binread("test.db", 16)).to eq("sqlitelite-db\0\0\0")
+    expect(File.binread("test.db", 8, 16).unpack("L<L<")).to eq([2, 4])
+    expect(File.size("test.db")).to eq(4 * 4096)
+
+    # ヘッダを取り除くとversion 1のファイルと同じ形になる
+    File.binwrite("test.db", File.binread("test.db", 3 * 4096, 4096))
+    `rm -f test.db-hot`
+    result = run_script([
+      "select id where username = user14",
+      ".vacuum",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > (14)",
+      "Executed.",
+      "db > Before: 3 pages, 2 leaves, 1 of 1 leaf hops out of order (100.0%)",
+      "Vacuumed 14 rows into 2 leaves (fill 90%).",
+      "Converted file format from version 1 to 2.",
+      "After: 3 pages, 2 leaves, 0 of 1 leaf hops out of order (0.0%)",
+      "db > ",
+    ])
+    expect(File.binread("test.db", 13)).to eq("sqlitelite-db")
+  end
+
+  it 'backs up only the pages changed since the last backup' do
+    script = (1..14).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".backup backup.db incremental"
+    script << "insert 15 user15 person15@example.com"
+    script << ".backup backup.db incremental"
+    script << ".backup backup.db incremental"
+    script << ".backup"
+    script << ".exit"
+    result = run_script(script)
+
+    # 最初は前回のバックアップがないので全体を写す
+    expect(result[14..result.length]).to eq([
+      "db > Backed up 3 of 3 pages to backup.db (full).",
+      "db > Executed.",
+      "db > Backed up 1 of 3 pages to backup.db (incremental).",
+      "db > Backed up 0 of 3 pages to backup.db (incremental).",
+      "db > Error: Usage: .backup <path> [incremental]",
+      "db > ",
+    ])
+
+    # 閉じた後も変更したページは記録に残る
+    run_script([
+      "update set username = changed where id = 1",
+      ".exit",
+    ])
+    result = run_script([
+      ".backup backup.db incremental",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Backed up 1 of 3 pages to backup.db (incremental).",
+      "db > ",
+    ])
+
+    output = IO.popen("./db backup.db", "r+") do |pipe|
+      pipe.puts "select id, username where username = changed"
+      pipe.puts "select id where username = user15"
+      pipe.puts ".exit"
+      pipe.close_write
+      pipe.gets(nil)
+    end
+    expect(output.split("\n")).to eq([
+      "db > (1, changed)",
+      "Executed.",
+      "db > (15)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'deletes rows and shrinks the tree' do
+    script = (1..20).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "delete where id <= 12"
+    script << ".btree"
+    script << "delete where id = 100"
+    script << "delete where id > 18"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[20..result.length]).to eq([
+      "db > Executed.",
+      "db > Tree:",
+      "- leaf (size 8)",
+      *(13..20).map { |i| "  - #{i}" },
+      "db > Executed.",
+      "db > Executed.",
+      "db > ",
+    ])
+
+    result = run_script([
+      "insert 13 user13 person13@example.com",
+      "select id",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > Error: Duplicate key.",
+      "db > (13)",
+      *(14..18).map { |i| "(#{i})" },
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'updates rows in place' do
+    script = (1..3).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "update set username = alice, email = alice@example.com where id = 2"
+    script << "update set email = other@example.com where id >= 3"
+    script << "update set id = 5 where id = 1"
+    script << "delete where username = user1"
+    script << "delete where id = -1"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[3..result.length]).to eq([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ID must be positive.",
+      "db > (1, user1, person1@example.com)",
+      "(2, alice, alice@example.com)",
+      "(3, user3, other@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'reads a point-in-time view while a snapshot is open' do
+    script = (1..12).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".snapshot begin"
+    script << ".snapshot begin"
+    # 葉の分割と削除，更新は退避したページには影響しない
+    script << "insert 13 user13 person13@example.com"
+    script << "insert 14 user14 person14@example.com"
+    script << "delete where id < 3"
+    script << "update set username = bob where id = 5"
+    script << "select id, username where username like user1%"
+    script << ".snapshot end"
+    script << ".snapshot end"
+    script << "select id, username where username like user1%"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[12..result.length]).to eq([
+      "db > db > Error: Snapshot already open.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1, user1)",
+      "(10, user10)",
+      "(11, user11)",
+      "(12, user12)",
+      "Executed.",
+      "db > db > Error: No snapshot open.",
+      "db > (10, user10)",
+      "(11, user11)",
+      "(12, user12)",
+      "(13, user13)",
+      "(14, user14)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'preserves pages that are not loaded yet when a snapshot is open' do
+    script = (1..8).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".vacuum 10"
+    script << ".exit"
+    run_script(script)
+
+    # hotファイルがなければ，開いた直後はどのページも読み込まれていない
+    `rm -f test.db-hot`
+    result = run_script([
+      ".snapshot begin",
+      # 葉の併合で子の親を付け替える時に，まだ読んでいない子も退避する
+      "delete where id = 1",
+      "select id",
+      ".snapshot end",
+      "select id",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > db > Executed.",
+      "db > (1)",
+      "(2)",
+      "(3)",
+      "(4)",
+      "(5)",
+      "(6)",
+      "(7)",
+      "(8)",
+      "Executed.",
+      "db > db > (2)",
+      "(3)",
+      "(4)",
+      "(5)",
+      "(6)",
+      "(7)",
+      "(8)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'serves pipelined statements to clients over a unix socket' do
+    server = IO.popen("./db test.db --serve test.sock", "r")
+    expect(server.gets).to eq("Listening on test.sock\n")
+
+    # 2つのクライアントが同じpagerを使う
+    output = IO.popen("./db --connect test.sock", "r+") do |pipe|
+      pipe.puts "insert 1 user1 person1@example.com"
+      pipe.puts "insert 2 user2 person2@example.com"
+      pipe.puts "insert 1 user1 person1@example.com"
+      pipe.puts ".exit"
+      pipe.close_write
+      pipe.gets(nil)
+    end
+    expect(output.split("\n")).to eq([
+      "Executed.",
+      "Executed.",
+      "Error: Duplicate key.",
+    ])
+
+    output = IO.popen("./db --connect test.sock", "r+") do |pipe|
+      pipe.puts "select id, username"
+      pipe.puts ".btree"
+      pipe.close_write
+      pipe.gets(nil)
+    end
+    expect(output.split("\n")).to eq([
+      "(1, user1)",
+      "(2, user2)",
+      "Executed.",
+      "Error: Meta commands are not supported by the server.",
+    ])
+
+    Process.kill("TERM", server.pid)
+    server.close
+    expect(File.exist?("test.sock")).to eq(false)
+
+    result = run_script([
+      "select",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  ensure
+    Process.kill("TERM", server.pid) unless server.closed?
+    server.close unless server.closed?
+  end
+
+  it 'answers requests sent before the client stops writing' do
+    server = IO.popen("./db test.db --serve test.sock", "r")
+    expect(server.gets).to eq("Listening on test.sock\n")
+
+    # 要求を送ってすぐに送信側を閉じても，応答は返ってくる
+    socket = UNIXSocket.new("test.sock")
+    ["insert 1 a b", "select"].each do |request|
+      socket.write([request.bytesize].pack("L") + request)
+    end
+    socket.close_write
+    output = socket.read
+    socket.close
+    Process.kill("TERM", server.pid)
+    server.close
+
+    responses = []
+    until output.empty?
+      length = output.unpack1("L")
+      responses << output[4, length]
+      output = output[(4 + length)..-1]
+    end
+    expect(responses).to eq([
+      "Executed.\n",
+      "(1, a, b)\nExecuted.\n",
+    ])
+  ensure
+    Process.kill("TERM", server.pid) unless server.closed?
+    server.close unless server.closed?
+  end
+
+  it 'keeps a snapshot for each server connection' do
+    server = IO.popen("./db test.db --serve test.sock", "r")
+    expect(server.gets).to eq("Listening on test.sock\n")
+
+    request = lambda do |socket, statement|
+      socket.write([statement.bytesize].pack("L") + statement)
+      socket.read(socket.read(4).unpack1("L"))
+    end
+
+    reader = UNIXSocket.new("test.sock")
+    writer = UNIXSocket.new("test.sock")
+    results = [
+      request.call(writer, "insert 1 user1 person1@example.com"),
+      request.call(reader, ".snapshot begin"),
+      request.call(reader, ".snapshot begin"),
+      # 他の接続の書き込みはスナップショットに影響しない
+      request.call(writer, "insert 2 user2 person2@example.com"),
+      request.call(writer, "update set username = bob where id = 1"),
+      request.call(reader, "select id, username"),
+      request.call(writer, "select id, username"),
+      request.call(reader, ".snapshot end"),
+      request.call(reader, "select id, username"),
+      request.call(reader, ".snapshot end"),
+      # 閉じずに切断したスナップショットはサーバーが閉じる
+      request.call(writer, ".snapshot begin"),
+    ]
+    reader.close
+    writer.close
+    expect(results).to eq([
+      "Executed.\n",
+      "",
+      "Error: Snapshot already open.\n",
+      "Executed.\n",
+      "Executed.\n",
+      "(1, user1)\nExecuted.\n",
+      "(1, bob)\n(2, user2)\nExecuted.\n",
+      "",
+      "(1, bob)\n(2, user2)\nExecuted.\n",
+      "Error: No snapshot open.\n",
+      "",
+    ])
+  ensure
+    Process.kill("TERM", server.pid) unless server.closed?
+    server.close unless server.closed?
+  end
+
+  it 'explains the pages a statement touched' do
+    script = (1..13).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".explain insert 14 user14 person14@example.com"
+    script << ".explain select id where username = user3"
+    script << ".exit"
+    result = run_script(script, "--trace test.trace")
+
+    insert = result[13...result.index { |line| line.start_with?("db > (3)") }]
+    expect(insert[0..1]).to eq(["db > Executed.", "Explain:"])
+    expect(insert.include?("- page 0 leaf hit")).to eq(true)
+    expect(insert.include?("leaf_splits: 1")).to eq(true)
+    expect(insert.include?("root_splits: 1")).to eq(true)
+
+    select = result[result.index { |line| line.start_with?("db > (3)") }...result.length]
+    expect(select[0..3]).to eq([
+      "db > (3)",
+      "Executed.",
+      "Explain:",
+      "- page 0 internal hit x2",
+    ])
+    expect(select.include?("binary_search_probes: 4")).to eq(true)
+    expect(select.include?("leaf_splits: 0")).to eq(true)
+
+    expect(File.size("test.trace") > 0).to eq(true)
+  ensure
+    `rm -f test.trace`
+  end
+
   it 'allows printing out the structure of a 4-leaf-node btree' do
     script = [
       "insert 18 user18 person18@example.com",